@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include "avim.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+struct client {
+	struct avim_conn *conn;
+	/* send times of the requests in flight, oldest first */
+	uint64_t *sent;
+	size_t nsent, ndone;
+};
+
+pid_t pid;
+struct avim_conn *vim;
+struct client *clients;
+uint64_t *lat;
+uint64_t nbytes;
+char *port, *sockpath;
+const char *cmd = "change";
+char *payload;
+size_t nclients = 16, nreqs = 10000, size = 64, depth = 1;
+int v1, json, tcp;
+
+void usage(void) {
+	fprintf(stderr, "usage: %s [-1jt] [-c clients] [-d depth] "
+	        "[-m command] [-n requests] [-s size] [avim]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+size_t num(const char *s) {
+	char *end;
+	unsigned long n = strtoul(s, &end, 0);
+	if (*s == '\0' || *end != '\0') {
+		usage();
+	}
+	return n;
+}
+
+uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+void nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		error(EXIT_FAILURE, errno, "fcntl");
+	}
+}
+
+void start(const char *path) {
+	int in[2], out[2];
+	if (pipe(in) == -1 || pipe(out) == -1) {
+		error(EXIT_FAILURE, errno, "pipe");
+	}
+	pid = fork();
+	if (pid == -1) {
+		error(EXIT_FAILURE, errno, "fork");
+	} else if (pid == 0) {
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execl(path, path, json ? "-j" : NULL, (char *)NULL);
+		error(EXIT_FAILURE, errno, "%s", path);
+	}
+	close(in[0]);
+	close(out[1]);
+	nonblock(out[0]);
+	nonblock(in[1]);
+	vim = avim_create(out[0], in[1]);
+	vim->json = json;
+}
+
+/* Answers like s:CtrlRecv() in plugin/acme.vim */
+void answer(avim_strv msg) {
+	size_t n = vec_len(&msg), i = 1;
+	if (n < 2) {
+		return;
+	}
+	if (msg[1][0] == '@' && n > 2) {
+		i++;
+	}
+	char *c = msg[i], *r = xasprintf("resp:%s", c);
+	const char *resp[4];
+	size_t len = 0;
+	while (len < i) {
+		resp[len] = msg[len];
+		len++;
+	}
+	resp[len++] = r;
+	if (strcmp(c, "hello") == 0) {
+		resp[len++] = v1 ? "1" : "2";
+		vim->v2 = !v1;
+	} else if (strcmp(c, "port") == 0 && n > i + 1) {
+		port = xstrdup(msg[i + 1]);
+		sockpath = n > i + 2 ? xstrdup(msg[i + 2]) : "";
+		len = 0;
+	} else if (strcmp(c, "bufinfo") == 0) {
+		resp[len++] = payload;
+	} else if (strcmp(c, "change") == 0) {
+		resp[len++] = "1";
+	} else if (strcmp(c, "cwd") == 0) {
+		resp[len++] = "/";
+	}
+	if (len > 0) {
+		avim_send(vim, resp, len);
+	}
+	free(r);
+}
+
+void request(struct client *c) {
+	char id[24];
+	snprintf(id, sizeof(id), "@%zu", c->nsent);
+	const char *msg[] = {id, cmd, payload};
+	avim_send(c->conn, msg, ARRLEN(msg));
+	vec_push(&c->sent, now());
+	c->nsent++;
+}
+
+void receive(struct client *c) {
+	avim_strv msg;
+	while ((msg = avim_parse(c->conn)) != NULL) {
+		if (vec_len(&msg) > 1 && msg[0][0] == '@') {
+			vec_push(&lat, now() - c->sent[0]);
+			vec_erase(&c->sent, 0, 1);
+			c->ndone++;
+			if (c->nsent < nreqs) {
+				request(c);
+			}
+		} else if (!v1) {
+			avim_ack(c->conn, msg, vec_len(&msg));
+		}
+		vec_free(&msg);
+	}
+	avim_pop(c->conn);
+}
+
+void pump(struct avim_conn *conn, short revents, int count) {
+	ssize_t n;
+	if (revents & POLLOUT) {
+		while (conn->txlen > 0 && (n = avim_tx(conn)) > 0) {
+			nbytes += count ? n : 0;
+		}
+	}
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		while (conn->rxfd != -1 && (n = avim_rx(conn)) > 0) {
+			nbytes += count ? n : 0;
+		}
+		if (conn->rxfd == -1) {
+			error(EXIT_FAILURE, conn->err, "connection closed");
+		}
+	}
+}
+
+/* Runs until all clients got their responses, or until port is known */
+void loop(void) {
+	struct pollfd *fds = vec_new();
+	for (;;) {
+		size_t done = 0;
+		for (size_t i = 0, n = vec_len(&clients); i < n; i++) {
+			done += clients[i].ndone == nreqs;
+		}
+		if (vec_len(&clients) > 0 ? done == nclients : port != NULL) {
+			break;
+		}
+		vec_clear(&fds);
+		struct pollfd rx = {vim->rxfd, POLLIN, 0};
+		struct pollfd tx = {vim->txfd, 0, 0};
+		tx.events = vim->txlen > 0 ? POLLOUT : 0;
+		vec_push(&fds, rx);
+		vec_push(&fds, tx);
+		for (size_t i = 0, n = vec_len(&clients); i < n; i++) {
+			struct avim_conn *conn = clients[i].conn;
+			struct pollfd pfd = {conn->rxfd, POLLIN, 0};
+			pfd.events |= conn->txlen > 0 ? POLLOUT : 0;
+			vec_push(&fds, pfd);
+		}
+		while (poll(fds, vec_len(&fds), -1) == -1) {
+			if (errno != EINTR) {
+				error(EXIT_FAILURE, errno, "poll");
+			}
+		}
+		pump(vim, fds[0].revents | fds[1].revents, 0);
+		avim_strv msg;
+		while ((msg = avim_parse(vim)) != NULL) {
+			answer(msg);
+			vec_free(&msg);
+		}
+		avim_pop(vim);
+		for (size_t i = 0, n = vec_len(&clients); i < n; i++) {
+			pump(clients[i].conn, fds[i + 2].revents, 1);
+			receive(&clients[i]);
+			pump(clients[i].conn, POLLOUT, 1);
+		}
+		pump(vim, POLLOUT, 0);
+	}
+	vec_free(&fds);
+}
+
+int cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+	argv0 = argv[0];
+	int opt;
+	while ((opt = getopt(argc, argv, "1c:d:jm:n:s:t")) != -1) {
+		switch (opt) {
+		case '1':
+			v1 = 1;
+			break;
+		case 'c':
+			nclients = num(optarg);
+			break;
+		case 'd':
+			depth = num(optarg);
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'm':
+			cmd = optarg;
+			break;
+		case 'n':
+			nreqs = num(optarg);
+			break;
+		case 's':
+			size = num(optarg);
+			break;
+		case 't':
+			tcp = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind > 1 || nclients == 0 || nreqs == 0 || depth == 0) {
+		usage();
+	}
+	depth = depth < nreqs ? depth : nreqs;
+	signal(SIGPIPE, SIG_IGN);
+	payload = xmalloc(size + 1);
+	memset(payload, 'x', size);
+	payload[size] = '\0';
+	clients = vec_new();
+	lat = vec_new();
+	start(optind < argc ? argv[optind] : "./avim");
+	loop();
+	setenv("ACMEVIMPORT", port, 1);
+	setenv("ACMEVIMSOCK", tcp ? "" : sockpath, 1);
+	struct client *c = vec_dig(&clients, -1, nclients);
+	for (size_t i = 0; i < nclients; i++) {
+		c[i].conn = avim_connect();
+		c[i].sent = vec_new();
+		c[i].nsent = c[i].ndone = 0;
+		nonblock(c[i].conn->rxfd);
+		if (v1) {
+			/* drop the hello, stay with v1 framing */
+			free(c[i].conn->tx[0].d);
+			vec_clear(&c[i].conn->tx);
+			c[i].conn->txlen = 0;
+		}
+	}
+	uint64_t t = now();
+	for (size_t i = 0; i < nclients; i++) {
+		for (size_t j = 0; j < depth; j++) {
+			request(&c[i]);
+		}
+	}
+	loop();
+	t = MAX(now() - t, 1);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	size_t n = vec_len(&lat);
+	qsort(lat, n, sizeof(lat[0]), cmp);
+	printf("%zu clients, %zu requests of %zu bytes, depth %zu, %s, %s%s\n",
+	       nclients, n, size, depth, tcp ? "tcp" : "unix", v1 ? "v1" : "v2",
+	       json ? ", json to vim" : "");
+	printf("%.0f msg/s, %.2f MB/s, p50 %" PRIu64 "us, p99 %" PRIu64
+	       "us, max %" PRIu64 "us\n", n * 1e6 / t, nbytes / (double)t,
+	       lat[n / 2], lat[n * 99 / 100], lat[n - 1]);
+	return 0;
+}
@@ -1,49 +1,398 @@
 #ifndef ACMD_H
 #define ACMD_H
 
+#define _GNU_SOURCE
 #include "avim.h"
+#include "hmap.h"
+#include <time.h>
+
+/* Milliseconds after which readbuf() gives up on vim */
+#define READ_TIMEOUT 2000
 
 typedef void msg_cb(avim_strv);
 typedef void cmd_func(void);
+typedef void timer_cb(void);
 
 struct cmd {
 	const char *name;
 	cmd_func *func;
 };
 
+struct pending {
+	unsigned int id;
+	msg_cb *cb;
+	/* memfd read by vim, closed with the response */
+	int fd;
+};
+
+struct timer {
+	/* deadline in milliseconds, see now_ms() */
+	uint64_t when;
+	unsigned int id;
+	timer_cb *cb;
+};
+
+/* contents of a buffer at changedtick tick */
+struct text {
+	char *path;
+	char *tick;
+	char *data;
+};
+
 const char *avimbuf;
 struct { char *d; size_t len, size; } buf;
 struct avim_conn *conn;
+/* requests awaiting a response by id */
+struct hmap *pending;
 char *cwd;
+/* gets the events pushed by vim, see subscribe() */
+msg_cb *onevent;
+/* struct text by path, the one being read */
+struct hmap *texts;
+struct text *reading;
+/* min-heap of the deadlines of the timers, see timer_add() */
+struct timer *timers;
+unsigned int lasttimer;
 
-static int process(const char *cmd, msg_cb *cb) {
+static struct pending *findpending(unsigned int id) {
+	intptr_t *p = hmap_get(pending, id);
+	return p != NULL ? (struct pending *)*p : NULL;
+}
+
+/*
+ * Copies the fields of msg to d, so that they stay valid when the callbacks
+ * read more messages, which reuses the receive buffers of conn.
+ */
+static void own(avim_strv msg, avim_buf *d) {
+	size_t n = vec_len(&msg), off = 0;
+	for (size_t i = 0; i < n; i++) {
+		avim_pushn(d, msg[i], strlen(msg[i]) + 1);
+	}
+	for (size_t i = 0; i < n; i++) {
+		msg[i] = &(*d)[off];
+		off += strlen(msg[i]) + 1;
+	}
+}
+
+static void process(void) {
 	if (conn->rxfd == -1) {
 		error(EXIT_FAILURE, conn->err, "connection closed");
 	}
-	int responded = 0;
 	for (;;) {
 		avim_strv msg = avim_parse(conn);
 		if (msg == NULL) {
 			break;
 		}
-		if (vec_len(&msg) > 0 && strncmp(msg[0], "resp:", 5) == 0 &&
-		    strcmp(&msg[0][5], cmd) == 0) {
+		avim_buf d = vec_new();
+		own(msg, &d);
+		intptr_t val = 0;
+		if (vec_len(&msg) > 1 && msg[0][0] == '@') {
+			hmap_del(pending, strtoul(&msg[0][1], NULL, 10), &val);
+			vec_erase(&msg, 0, 1);
+		} else if (!avim_ack(conn, msg, vec_len(&msg)) &&
+		           onevent != NULL && vec_len(&msg) > 1 &&
+		           strcmp(msg[0], "event") == 0) {
+			onevent(msg);
+		}
+		struct pending *p = (struct pending *)val;
+		if (p != NULL) {
+			msg_cb *cb = p->cb;
+			if (p->fd != -1) {
+				close(p->fd);
+			}
+			free(p);
 			if (cb != NULL) {
 				cb(msg);
 			}
-			responded = 1;
 		}
 		vec_free(&msg);
+		vec_free(&d);
 	}
 	avim_pop(conn);
-	return responded;
+}
+
+static unsigned int request_async(const char **argv, size_t argc,
+                                  msg_cb *cb) {
+	static unsigned int lastid;
+	char id[16];
+	struct pending *p = xmalloc(sizeof(*p));
+	p->id = ++lastid;
+	p->cb = cb;
+	p->fd = -1;
+	snprintf(id, sizeof(id), "@%u", p->id);
+	const char **msg = vec_new();
+	vec_push(&msg, id);
+	for (size_t i = 0; i < argc; i++) {
+		vec_push(&msg, argv[i]);
+	}
+	avim_send(conn, msg, vec_len(&msg));
+	vec_free(&msg);
+	*hmap_put(pending, p->id) = (intptr_t)p;
+	return p->id;
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t)1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_swap(size_t i, size_t j) {
+	struct timer t = timers[i];
+	timers[i] = timers[j];
+	timers[j] = t;
+}
+
+static void timer_fix(size_t i) {
+	size_t n = vec_len(&timers);
+	for (; i > 0 && timers[(i - 1) / 2].when > timers[i].when;
+	     i = (i - 1) / 2) {
+		timer_swap(i, (i - 1) / 2);
+	}
+	for (size_t j; (j = 2 * i + 1) < n; i = j) {
+		if (j + 1 < n && timers[j + 1].when < timers[j].when) {
+			j++;
+		}
+		if (timers[i].when <= timers[j].when) {
+			break;
+		}
+		timer_swap(i, j);
+	}
+}
+
+static void timer_remove(size_t i) {
+	size_t last = vec_len(&timers) - 1;
+	timers[i] = timers[last];
+	vec_erase(&timers, last, 1);
+	if (i < last) {
+		timer_fix(i);
+	}
+}
+
+/* Calls cb once from block() after ms milliseconds */
+static unsigned int timer_add(unsigned int ms, timer_cb *cb) {
+	struct timer t = {now_ms() + ms, ++lasttimer, cb};
+	vec_push(&timers, t);
+	timer_fix(vec_len(&timers) - 1);
+	return t.id;
+}
+
+static void timer_del(unsigned int id) {
+	for (size_t i = 0, n = vec_len(&timers); i < n; i++) {
+		if (timers[i].id == id) {
+			timer_remove(i);
+			break;
+		}
+	}
+}
+
+/* Runs the expired timers, but not the ones they add */
+static void timer_run(void) {
+	uint64_t t = now_ms();
+	unsigned int last = lasttimer;
+	while (vec_len(&timers) > 0 && timers[0].when <= t &&
+	       timers[0].id <= last) {
+		timer_cb *cb = timers[0].cb;
+		timer_remove(0);
+		cb();
+	}
+}
+
+/* Returns the select() timeout until deadline, NULL if it is 0 */
+static struct timeval *timeout(struct timeval *tv, uint64_t deadline) {
+	if (deadline == 0) {
+		return NULL;
+	}
+	uint64_t t = now_ms(), ms = deadline > t ? deadline - t : 0;
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = ms % 1000 * 1000;
+	return tv;
+}
+
+/* Returns the deadline of the next timer, 0 if there is none */
+static uint64_t timer_next(void) {
+	return vec_len(&timers) > 0 ? timers[0].when : 0;
+}
+
+/*
+ * Exchanges messages with vim until stdin if in or fd gets readable, which
+ * is returned, or until deadline (0 for none), when -1 is returned.
+ */
+static int pump(int in, int fd, uint64_t deadline) {
+	int nfds = MAX(fd, MAX(conn->rxfd, conn->txfd)) + 1;
+	fd_set readfds, writefds;
+	struct timeval tv;
+	for (;;) {
+		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
+		if (in) {
+			FD_SET(0, &readfds);
+		}
+		FD_SET(conn->rxfd, &readfds);
+		if (conn->txlen > 0) {
+			FD_SET(conn->txfd, &writefds);
+		}
+		if (fd >= 0) {
+			FD_SET(fd, &readfds);
+		}
+		int n;
+		while ((n = select(nfds, &readfds, &writefds, NULL,
+		                   timeout(&tv, deadline))) == -1) {
+			if (errno != EINTR) {
+				error(EXIT_FAILURE, errno, "select");
+			}
+		}
+		if (n == 0) {
+			return -1;
+		}
+		if (FD_ISSET(conn->txfd, &writefds)) {
+			avim_tx(conn);
+		}
+		if (FD_ISSET(conn->rxfd, &readfds)) {
+			avim_rx(conn);
+			process();
+			if (!in && fd < 0) {
+				return -1;
+			}
+		}
+		if (in && FD_ISSET(0, &readfds)) {
+			return 0;
+		}
+		if (fd >= 0 && FD_ISSET(fd, &readfds)) {
+			return fd;
+		}
+		if (deadline != 0 && now_ms() >= deadline) {
+			/* vim keeps the socket readable */
+			return -1;
+		}
+	}
+}
+
+/*
+ * Waits for the response to request id for up to ms milliseconds, or without
+ * limit if ms is 0. Returns 0 if it timed out, its response is then ignored.
+ */
+static int await(unsigned int id, unsigned int ms) {
+	uint64_t deadline = ms != 0 ? now_ms() + ms : 0;
+	struct pending *p;
+	while ((p = findpending(id)) != NULL) {
+		if (deadline != 0 && now_ms() >= deadline) {
+			hmap_del(pending, id, NULL);
+			if (p->fd != -1) {
+				close(p->fd);
+			}
+			free(p);
+			return 0;
+		}
+		pump(0, -1, deadline);
+	}
+	return 1;
+}
+
+/* Sends a request and waits up to ms milliseconds for it, see await() */
+static int request_within(const char **argv, size_t argc, msg_cb *cb,
+                          unsigned int ms) {
+	return await(request_async(argv, argc, cb), ms);
 }
 
 static void request(const char **argv, size_t argc, msg_cb *cb) {
-	avim_send(conn, argv, argc);
-	do {
-		avim_sync(&conn, 1, NULL, 0);
-	} while (!process(argv[0], cb));
+	request_within(argv, argc, cb, 0);
+}
+
+/*
+ * Sends a change request. If the lines in argv[4:] are large, then they are
+ * written to a memfd instead, which vim reads with the load command.
+ */
+static unsigned int change_async(const char **argv, size_t argc,
+                                 msg_cb *cb) {
+	size_t len = 0;
+	for (size_t i = 4; i < argc; i++) {
+		len += strlen(argv[i]) + 1;
+	}
+	if (len < AVIM_BULK_MIN) {
+		return request_async(argv, argc, cb);
+	}
+	char *d = vec_new(), path[48];
+	for (size_t i = 4; i < argc; i++) {
+		avim_push(&d, argv[i]);
+		vec_push(&d, '\n');
+	}
+	int fd = avim_memfd(d, len, path, sizeof(path));
+	vec_free(&d);
+	if (fd == -1) {
+		return request_async(argv, argc, cb);
+	}
+	const char *load[] = {"load", argv[1], argv[2], argv[3], path};
+	unsigned int id = request_async(load, ARRLEN(load), cb);
+	findpending(id)->fd = fd;
+	return id;
+}
+
+static void change(const char **argv, size_t argc, msg_cb *cb) {
+	await(change_async(argv, argc, cb), 0);
+}
+
+/*
+ * Subscribes to event (change, cursor, layout or write) in the buffers of
+ * files, or in all of them. Events arrive as {"event", event, args...}.
+ */
+static void subscribe(const char *event, const char **files, size_t n,
+                      msg_cb *cb) {
+	const char **msg = vec_new();
+	vec_push(&msg, "subscribe");
+	vec_push(&msg, event);
+	for (size_t i = 0; i < n; i++) {
+		vec_push(&msg, files[i]);
+	}
+	onevent = cb;
+	request(msg, vec_len(&msg), NULL);
+	vec_free(&msg);
+}
+
+static void settext(avim_strv msg) {
+	size_t n = vec_len(&msg);
+	if (n < 2) {
+		/* not loaded in vim */
+		free(reading->data);
+		reading->data = NULL;
+	} else if (n > 2 || reading->tick == NULL ||
+	           strcmp(reading->tick, msg[1]) != 0) {
+		size_t len = 0;
+		for (size_t i = 2; i < n; i++) {
+			len += strlen(msg[i]) + 1;
+		}
+		char *p = xrealloc(reading->data, len + 1);
+		reading->data = p;
+		for (size_t i = 2; i < n; i++) {
+			p = stpcpy(p, msg[i]);
+			*p++ = '\n';
+		}
+		*p = '\0';
+	}
+	free(reading->tick);
+	reading->tick = n > 1 ? xstrdup(msg[1]) : NULL;
+}
+
+/*
+ * Returns the contents of the buffer of path, or NULL if vim has not loaded
+ * it or does not answer in time. They are cached and only transferred again
+ * after the buffer changed.
+ */
+static const char *readbuf(const char *path) {
+	intptr_t *t = hmap_get(texts, path);
+	if (t == NULL) {
+		reading = xmalloc(sizeof(*reading));
+		*reading = (struct text){xstrdup(path), NULL, NULL};
+		*hmap_put(texts, reading->path) = (intptr_t)reading;
+	} else {
+		reading = (struct text *)*t;
+	}
+	const char *cmd[] = {"read", path, "1", "-1", reading->tick};
+	if (!request_within(cmd, ARRLEN(cmd) - (reading->tick == NULL),
+	                    settext, READ_TIMEOUT)) {
+		return NULL;
+	}
+	return reading->data;
 }
 
 static void clear(void) {
@@ -74,30 +423,13 @@ static struct cmd *match(struct cmd cmds[]) {
 	return NULL;
 }
 
+/* Runs the timers until stdin or fd gets readable, which is returned */
 static int block(int fd) {
-	int nfds = (fd > conn->rxfd ? fd : conn->rxfd) + 1;
-	fd_set readfds;
 	for (;;) {
-		FD_ZERO(&readfds);
-		FD_SET(0, &readfds);
-		FD_SET(conn->rxfd, &readfds);
-		if (fd >= 0) {
-			FD_SET(fd, &readfds);
-		}
-		while (select(nfds, &readfds, NULL, NULL, NULL) == -1) {
-			if (errno != EINTR) {
-				error(EXIT_FAILURE, errno, "select");
-			}
-		}
-		if (FD_ISSET(conn->rxfd, &readfds)) {
-			avim_rx(conn);
-			process(NULL, NULL);
-		}
-		if (FD_ISSET(0, &readfds)) {
-			return 0;
-		}
-		if (fd >= 0 && FD_ISSET(fd, &readfds)) {
-			return fd;
+		timer_run();
+		int ret = pump(1, fd, timer_next());
+		if (ret != -1) {
+			return ret;
 		}
 	}
 }
@@ -119,6 +451,9 @@ static void init(const char *av0) {
 		error(EXIT_FAILURE, EINVAL, "ACMEVIMBUF");
 	}
 	conn = avim_connect();
+	pending = hmap_new(0);
+	texts = hmap_new(1);
+	timers = vec_new();
 	cwd = xgetcwd();
 	clear();
 }
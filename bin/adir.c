@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include "io.h"
+#include <locale.h>
+#include <wchar.h>
+
+/* Gap between columns */
+#define SPACE 2
+
+void usage(void) {
+	fprintf(stderr, "usage: %s [-w width] [dir | -]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Returns the display width of s in vim, which shows bytes that are invalid
+ * in a multibyte locale as <xx>.
+ */
+size_t strwidth(const char *s) {
+	mbstate_t mbs = {0};
+	size_t width = 0, n;
+	wchar_t wc;
+	while (*s != '\0') {
+		if ((unsigned char)*s < 0x80) {
+			width++;
+			s++;
+			continue;
+		}
+		n = mbrtowc(&wc, s, MB_CUR_MAX, &mbs);
+		if (n == (size_t)-1 || n == (size_t)-2) {
+			memset(&mbs, 0, sizeof(mbs));
+			width += MB_CUR_MAX > 1 ? 4 : 1;
+			s++;
+			continue;
+		}
+		int w = wcwidth(wc);
+		width += w > 0 ? w : 0;
+		s += n;
+	}
+	return width;
+}
+
+/*
+ * Prints words in as many columns as fit into width, filled top to bottom,
+ * like s:Columnate() in plugin/acme.vim.
+ */
+void columnate(strvec words, size_t width) {
+	size_t n = vec_len(&words), minw = 0, ncol, nrow = n;
+	size_t *wordw = xmalloc(n * sizeof(*wordw) + 1);
+	size_t *colw = vec_new();
+	for (size_t i = 0; i < n; i++) {
+		wordw[i] = strwidth(words[i]);
+		minw = i == 1 || wordw[i] < minw ? wordw[i] : minw;
+	}
+	/* the first word is ../ which does not count for the estimate */
+	for (ncol = MIN(n, width / MAX(minw, 5)); ncol > 1; ncol--) {
+		nrow = (n + ncol - 1) / ncol;
+		size_t total = (ncol - 1) * SPACE;
+		vec_clear(&colw);
+		for (size_t c = 0; c < ncol && total <= width; c++) {
+			size_t w = 0;
+			for (size_t i = c * nrow; i < MIN(n, (c + 1) * nrow); i++) {
+				w = MAX(w, wordw[i]);
+			}
+			vec_push(&colw, w);
+			total += w;
+		}
+		if (total <= width) {
+			break;
+		}
+	}
+	if (ncol <= 1) {
+		nrow = n;
+	}
+	for (size_t r = 0; r < nrow; r++) {
+		for (size_t i = r; i < n; i += nrow) {
+			fputs(words[i], stdout);
+			for (size_t j = i + nrow < n ?
+			     colw[i / nrow] - wordw[i] + SPACE : 0; j > 0; j--) {
+				putchar(' ');
+			}
+		}
+		putchar('\n');
+	}
+	vec_free(&colw);
+	free(wordw);
+}
+
+int main(int argc, char *argv[]) {
+	argv0 = argv[0];
+	setlocale(LC_ALL, "");
+	size_t width = 80;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:")) != -1) {
+		char *end;
+		switch (opt) {
+		case 'w':
+			width = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0') {
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind > 1) {
+		usage();
+	}
+	const char *dir = optind < argc ? argv[optind] : ".";
+	strvec words;
+	if (strcmp(dir, "-") == 0) {
+		/* lays out a listing printed before with -w 0 */
+		words = splitlines(xreadall(stdin));
+	} else {
+		words = lsflags(dir, LS_SLASH);
+		vec_insert(&words, 0, "../");
+	}
+	columnate(words, width);
+	return 0;
+}
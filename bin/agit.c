@@ -130,7 +130,7 @@ void show(list_func *ls) {
 	} else {
 		ls = NULL;
 	}
-	request(argv, vec_len(&argv), changed);
+	change(argv, vec_len(&argv), changed);
 	if (ls) {
 		ls();
 	}
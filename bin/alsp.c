@@ -24,18 +24,8 @@ struct typeinfo {
 	size_t next;
 };
 
-struct typeparent {
-	unsigned int id;
-	size_t parent;
-};
-
 typedef void msghandler(json_t *);
 
-struct req {
-	unsigned int id;
-	msghandler *handler;
-};
-
 const char *msgtype[] = {
 	"", "Error", "Warning", "Info", "Log", "Debug"
 };
@@ -49,28 +39,34 @@ const char *symkind[] = {
 };
 
 struct cmd *cmds;
-avim_strv docs;
+/* paths of the open documents */
+struct hmap *docs;
 struct filepos filepos;
-struct req *requests;
+/* handlers of the pending requests by id */
+struct hmap *requests;
 struct chan rx;
 FILE *tx;
 struct typeinfo *types;
-struct typeparent *typeparent;
+/* indexes in types of the parents of the pending type queries by id */
+struct hmap *typeparent;
 const char *server;
 
 void setpos(avim_strv msg) {
-	if (vec_len(&msg) > 3) {
-		const char *path = msg[1];
+	if (vec_len(&msg) > 3 && msg[1][0] != '\0') {
 		int line = atoi(msg[2]);
 		int col = atoi(msg[3]);
 		if (line > 0 && col > 0) {
-			filepos.path = xstrdup(path);
+			filepos.path = xstrdup(msg[1]);
 			filepos.line = line - 1;
 			filepos.col = col - 1;
 		}
 	}
 }
 
+/*
+ * Gets vim's cursor position when a command runs and saves the files, which
+ * the server reads from disk unless they are open.
+ */
 int getpos() {
 	free(filepos.path);
 	filepos.path = NULL;
@@ -84,6 +80,17 @@ int getpos() {
 	return 1;
 }
 
+/* Returns the contents of path, including unsaved changes in vim */
+avim_buf readtext(const char *path) {
+	const char *text = readbuf(path);
+	if (text == NULL) {
+		return readfile(path);
+	}
+	avim_buf data = vec_new();
+	avim_pushn(&data, text, strlen(text) + 1);
+	return data;
+}
+
 #define GET(...) get(__VA_ARGS__, NULL)
 json_t *get(json_t *, const char *, ...) __attribute__((sentinel));
 json_t *get(json_t *v, const char *key, ...) {
@@ -239,7 +246,7 @@ void showmatches(json_t *msg) {
 				printpath(path);
 				vec_free(&lines);
 				vec_free(&data);
-				data = readfile(path);
+				data = readtext(path);
 				if (data != NULL) {
 					lines = splitlines(data);
 				}
@@ -321,7 +328,7 @@ void dumptypes(void) {
 		json_decref(types[i].obj);
 	}
 	vec_clear(&types);
-	vec_clear(&typeparent);
+	hmap_clear(typeparent);
 }
 
 #define JSON(type, ...) jsonref(json_ ## type(__VA_ARGS__), #type)
@@ -384,8 +391,7 @@ json_t *req(const char *method, msghandler *handler, json_t *params) {
 	json_t *m = msg(method, params);
 	id++;
 	objset(m, "id", JSON(integer, id));
-	struct req r = {id, handler};
-	vec_push(&requests, r);
+	*hmap_put(requests, id) = (intptr_t)handler;
 	return m;
 }
 
@@ -397,13 +403,9 @@ void handle(json_t *msg) {
 			fprintf(stderr, "Error: %s\n", json_string_value(err));
 		}
 		unsigned int id = json_integer_value(GET(msg, "id"));
-		size_t req = vec_findi(&requests, id);
-		if (req != -1) {
-			msghandler *handler = requests[req].handler;
-			vec_erase(&requests, req, 1);
-			if (err == NULL) {
-				handler(msg);
-			}
+		intptr_t handler;
+		if (hmap_del(requests, id, &handler) && err == NULL) {
+			((msghandler *)handler)(msg);
 		}
 	} else {
 		// request or notification
@@ -505,8 +507,7 @@ void querytype(const char *method, size_t parent, msghandler *handler) {
 	json_t *params = OBJ("item", json_incref(types[parent].obj));
 	json_t *msg = req(method, handler, params);
 	unsigned int id = json_integer_value(GET(msg, "id"));
-	struct typeparent tp = {id, parent};
-	vec_push(&typeparent, tp);
+	*hmap_put(typeparent, id) = parent;
 	transmit(msg);
 }
 
@@ -521,12 +522,11 @@ void handletypes(json_t *msg) {
 		dir = -1;
 	} else {
 		unsigned int id = json_integer_value(GET(msg, "id"));
-		size_t p = vec_findi(&typeparent, id);
-		if (p == -1) {
+		intptr_t p;
+		if (!hmap_del(typeparent, id, &p)) {
 			return;
 		}
-		parent = typeparent[p].parent;
-		vec_erase(&typeparent, p, 1);
+		parent = p;
 	}
 	int level = parent != -1 ? types[parent].level + dir : 0;
 	json_t *res = GET(msg, "result");
@@ -537,7 +537,7 @@ void handletypes(json_t *msg) {
 			querytype(method[dir > 0], parent, handletypes);
 		}
 	}
-	if (vec_len(&requests) == 0 && vec_len(&types) > 0) {
+	if (requests->len == 0 && vec_len(&types) > 0) {
 		if (dir < 0) {
 			dir = 1;
 			querytype(method[1], 0, handletypes);
@@ -551,7 +551,7 @@ int txtdocopen(const char *path) {
 	if (!indir(path, cwd)) {
 		return 0;
 	}
-	avim_buf data = readfile(path);
+	avim_buf data = readtext(path);
 	if (data == NULL) {
 		return 0;
 	}
@@ -563,7 +563,7 @@ int txtdocopen(const char *path) {
 			"text", JSON(string, data)))));
 	vec_free(&uri);
 	vec_free(&data);
-	vec_push(&docs, xstrdup(path));
+	hmap_put(docs, xstrdup(path));
 	return 1;
 }
 
@@ -595,18 +595,19 @@ void txtdoc(const char *method, msghandler *handler, json_t *params) {
 void openall(avim_strv msg) {
 	for (size_t i = 1; i + 4 < vec_len(&msg); i += 5) {
 		char *path = msg[i];
-		if (vec_finds(&docs, path) == -1) {
+		if (hmap_get(docs, path) == NULL) {
 			txtdocopen(path);
 		}
 	}
 }
 
 void closeall(void) {
-	for (size_t i = 0, n = vec_len(&docs); i < n; i++) {
-		txtdocclose(docs[i]);
-		free(docs[i]);
+	struct hmap_slot *doc;
+	for (size_t i = 0; (doc = hmap_next(docs, &i)) != NULL;) {
+		txtdocclose((char *)doc->key);
+		free((char *)doc->key);
 	}
-	vec_clear(&docs);
+	hmap_clear(docs);
 }
 
 json_t *capabilities(void) {
@@ -726,11 +727,11 @@ void guessinvocation(void) {
 int main(int argc, char *argv[]) {
 	init(argv[0]);
 	cmds = vec_new();
-	docs = vec_new();
-	requests = vec_new();
+	docs = hmap_new(1);
+	requests = hmap_new(0);
 	rx.buf = vec_new();
 	types = vec_new();
-	typeparent = vec_new();
+	typeparent = hmap_new(0);
 	if (argc > 1) {
 		spawn(&argv[1]);
 	} else {
@@ -738,7 +739,7 @@ int main(int argc, char *argv[]) {
 	}
 	int dirty = 1;
 	for (;;) {
-		if (dirty && vec_len(&requests) == 0) {
+		if (dirty && requests->len == 0) {
 			closeall();
 			printf("%s ", server);
 			menu(cmds);
@@ -747,7 +748,7 @@ int main(int argc, char *argv[]) {
 		if (block(rx.fd) == 0) {
 			input();
 			struct cmd *cmd = match(cmds);
-			if (cmd != NULL && vec_len(&requests) == 0) {
+			if (cmd != NULL && requests->len == 0) {
 				clear();
 				cmd->func();
 				dirty = 1;
@@ -0,0 +1,294 @@
+#include "acmd.h"
+#include <fcntl.h>
+
+/* lines of output kept in the buffer around the cursor */
+#define WINDOW 3000
+/* the window is moved once the cursor gets this close to its edges */
+#define MARGIN 500
+/* output is collected for this many milliseconds */
+#define FLUSH_DELAY 10
+
+pid_t pid;
+/* output of the command, -1 after its end */
+int out = -1;
+/* backing file with the output, size bytes of it are mapped at map */
+int store;
+size_t size;
+char *map;
+size_t maplen;
+/* offsets of the lines in store, the last one is where the next starts */
+size_t *lines;
+/* the buffer has the lines from base to base + shown */
+size_t base, shown;
+/* line of the cursor in the output */
+size_t cursor;
+unsigned int flushing;
+int registered;
+
+void usage(void) {
+	fprintf(stderr, "usage: %s cmd [arg...]\n", argv0);
+	exit(EXIT_FAILURE);
+}
+
+size_t nlines(void) {
+	return vec_len(&lines) - 1;
+}
+
+void spawn(char *argv[]) {
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		error(EXIT_FAILURE, errno, "pipe");
+	}
+	pid = fork();
+	if (pid == -1) {
+		error(EXIT_FAILURE, errno, "fork");
+	}
+	if (pid == 0) {
+		int null = open("/dev/null", O_RDONLY);
+		if (null == -1 || dup2(null, 0) == -1 || dup2(fds[1], 1) == -1 ||
+		    dup2(fds[1], 2) == -1) {
+			error(EXIT_FAILURE, errno, "dup2");
+		}
+		execvp(argv[0], argv);
+		error(EXIT_FAILURE, errno, "exec: %s", argv[0]);
+	}
+	close(fds[1]);
+	out = fds[0];
+}
+
+void mkstore(void) {
+	const char *dir = getenv("TMPDIR");
+	char *path = xasprintf("%s/apage.XXXXXX",
+	                       dir != NULL && dir[0] != '\0' ? dir : "/tmp");
+	store = mkstemp(path);
+	if (store == -1) {
+		error(EXIT_FAILURE, errno, "%s", path);
+	}
+	unlink(path);
+	free(path);
+}
+
+void append(const char *d, size_t n) {
+	for (size_t i = 0; i < n;) {
+		ssize_t w = write(store, &d[i], n - i);
+		if (w == -1 && errno != EINTR) {
+			error(EXIT_FAILURE, errno, "write");
+		}
+		i += MAX(w, 0);
+	}
+	for (const char *p = d; (p = memchr(p, '\n', d + n - p)) != NULL;) {
+		p++;
+		vec_push(&lines, size + (p - d));
+	}
+	size += n;
+}
+
+/* Stores the available output of the command */
+void collect(void) {
+	static char d[65536];
+	ssize_t n = read(out, d, sizeof(d));
+	if (n > 0) {
+		append(d, n);
+	} else if (n == 0 || errno != EINTR) {
+		if (size > lines[nlines()]) {
+			append("\n", 1);
+		}
+		close(out);
+		out = -1;
+		waitpid(pid, NULL, 0);
+	}
+}
+
+/* Returns the stored output, which is mapped as needed */
+const char *text(void) {
+	if (maplen < size) {
+		if (map != NULL) {
+			munmap(map, maplen);
+		}
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, store, 0);
+		if (map == MAP_FAILED) {
+			error(EXIT_FAILURE, errno, "mmap");
+		}
+		maplen = size;
+	}
+	return map;
+}
+
+/* Replaces the lines l1 to l2 of the buffer with the lines from i to j */
+void put(const char *l1, const char *l2, size_t i, size_t j) {
+	const char *p = text();
+	char *d = vec_new();
+	const char **cmd = vec_new();
+	vec_push(&cmd, "change");
+	vec_push(&cmd, avimbuf);
+	vec_push(&cmd, l1);
+	vec_push(&cmd, l2);
+	for (size_t k = i; k < j; k++) {
+		size_t len = lines[k + 1] - lines[k] - 1;
+		char *s = vec_dig(&d, -1, len + 1);
+		memcpy(s, &p[lines[k]], len);
+		s[len] = '\0';
+	}
+	for (size_t k = i, off = 0; k < j; k++) {
+		vec_push(&cmd, &d[off]);
+		off += lines[k + 1] - lines[k];
+	}
+	change_async(cmd, vec_len(&cmd), NULL);
+	vec_free(&cmd);
+	vec_free(&d);
+}
+
+/* Changes the buffer to have the lines from to on */
+void move(size_t to) {
+	size_t end = base + shown, toend = MIN(nlines(), to + WINDOW);
+	char l[24];
+	if (shown == 0 || to >= end || toend <= base) {
+		if (shown != 0 || toend > to) {
+			put("1", "-1", to, toend);
+		}
+	} else {
+		if (base < to) {
+			snprintf(l, sizeof(l), "%zu", to - base);
+			put("1", l, 0, 0);
+		} else if (to < base) {
+			put("1", "0", to, base);
+		}
+		if (toend < end) {
+			snprintf(l, sizeof(l), "-%zu", end - toend + 1);
+			put(l, "-1", 0, 0);
+		} else if (end < toend) {
+			put("-1", "-1", end, toend);
+		}
+	}
+	base = to;
+	shown = toend - to;
+}
+
+/* Returns the start of the window with line i in its middle */
+size_t center(size_t i) {
+	size_t n = nlines(), to = i > WINDOW / 2 ? i - WINDOW / 2 : 0;
+	return MIN(to, n > WINDOW ? n - WINDOW : 0);
+}
+
+void pager(size_t line) {
+	char l[24];
+	snprintf(l, sizeof(l), "%zu", line);
+	const char *cmd[] = {"pager", avimbuf, l};
+	request_async(cmd, ARRLEN(cmd) - (line == 0), NULL);
+}
+
+/* Moves the cursor to line i */
+void jump(size_t i) {
+	if (i < base + MIN(base, MARGIN) ||
+	    i + MIN(nlines() - base - shown, MARGIN) >= base + shown) {
+		move(center(i));
+	}
+	cursor = i;
+	pager(i - base + 1);
+}
+
+void flush(void) {
+	flushing = 0;
+	if (base + shown < nlines() && shown < WINDOW) {
+		move(base);
+	}
+	if (out == -1 && nlines() <= WINDOW) {
+		/* all of it fits into the buffer */
+		while (pending->len > 0) {
+			pump(0, -1, 0);
+		}
+		exit(0);
+	}
+	if (!registered && (shown == WINDOW || out == -1)) {
+		registered = 1;
+		pager(0);
+	}
+}
+
+/* Moves the window when the cursor gets close to one of its edges */
+void scroll(avim_strv msg) {
+	if (vec_len(&msg) < 4 || strcmp(msg[1], "cursor") != 0 ||
+	    pending->len > 0) {
+		/* the line can be from before the pending changes */
+		return;
+	}
+	size_t line = strtoul(msg[3], NULL, 10);
+	if (line == 0 || line > shown) {
+		return;
+	}
+	cursor = base + line - 1;
+	if ((line <= MARGIN && base > 0) ||
+	    (line + MARGIN > shown && base + shown < nlines())) {
+		move(center(cursor));
+	}
+}
+
+/* Goes to the next line containing s after the cursor */
+void search(const char *s) {
+	size_t n = nlines(), len = strlen(s);
+	if (n == 0) {
+		return;
+	}
+	const char *p = text(), *end = &p[lines[n]];
+	const char *from = &p[lines[MIN(cursor + 1, n)]];
+	const char *m = memmem(from, end - from, s, len);
+	if (m == NULL) {
+		m = memmem(p, from - p + MIN(len, (size_t)(end - from)), s, len);
+	}
+	if (m == NULL) {
+		return;
+	}
+	size_t lo = 0, hi = n;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (lines[mid] <= (size_t)(m - p)) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	const char *cmd[] = {"look", "", s, ""};
+	request_async(cmd, ARRLEN(cmd), NULL);
+	jump(lo);
+}
+
+/* Goes to the line number or the next occurrence of the text in buf */
+void command(void) {
+	size_t n = nlines();
+	char *end;
+	unsigned long l = strtoul(buf.d, &end, 10);
+	if (buf.d[0] == '\0' || n == 0) {
+		return;
+	} else if (strcmp(buf.d, "$") == 0) {
+		jump(n - 1);
+	} else if (buf.d[0] >= '0' && buf.d[0] <= '9' && *end == '\0') {
+		jump(MIN(MAX(l, 1), n) - 1);
+	} else {
+		search(buf.d);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	init(argv[0]);
+	if (argc < 2) {
+		usage();
+	}
+	lines = vec_new();
+	vec_push(&lines, 0);
+	mkstore();
+	spawn(&argv[1]);
+	const char *files[] = {avimbuf};
+	subscribe("cursor", files, ARRLEN(files), scroll);
+	for (;;) {
+		if (block(out) == 0) {
+			input();
+			command();
+		} else {
+			collect();
+			if (flushing == 0) {
+				flushing = timer_add(FLUSH_DELAY, flush);
+			}
+		}
+	}
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include "acmd.h"
+#include <fcntl.h>
 #include <pty.h>
 #include <regex.h>
 
@@ -7,9 +8,18 @@ struct ptybuf {
 	size_t c, i;
 };
 
+/* output of the pty is collected for this many milliseconds */
+#define FLUSH_DELAY 5
+/* the pty is not read while more changes than this are unanswered... */
+#define MAXPENDING 4
+/* ... or more bytes than this are queued for vim */
+#define MAXQUEUED (256 << 10)
+
 int chld;
 pid_t pid;
 int pty;
+struct ptybuf rx;
+unsigned int flushing;
 
 const char *ctrlregex = "\e\\[(\\?)?([0-9]*;*)*[A-Za-z]";
 regex_t ctrlreg;
@@ -70,7 +80,7 @@ void send_(struct ptybuf *buf) {
 	i = MAX(c, eol);
 	p[i] = '\0';
 	vec_push(&cmd, &p[bol]);
-	request(cmd, vec_len(&cmd), NULL);
+	change_async(cmd, vec_len(&cmd), NULL);
 	vec_free(&cmd);
 	vec_erase(&buf->d, i, n - i + 1);
 	vec_erase(&buf->d, 0, bol);
@@ -78,12 +88,18 @@ void send_(struct ptybuf *buf) {
 	buf->i = i - bol;
 }
 
-void read_(int fd, char **buf) {
+void flush(void) {
+	flushing = 0;
+	send_(&rx);
+}
+
+ssize_t read_(int fd, char **buf) {
 	static char d[4096];
 	ssize_t n = read(fd, d, sizeof d);
 	if (n > 0) {
 		memcpy(vec_dig(buf, vec_len(buf), n), d, n);
 	}
+	return n;
 }
 
 void write_(int fd, char **buf) {
@@ -155,33 +171,67 @@ int main(int argc, char *argv[]) {
 		tc.c_lflag |= ICANON;
 		tcsetattr(pty, TCSANOW, &tc);
 	}
-	struct ptybuf rx = {.d = vec_new()};
+	rx.d = vec_new();
 	char *tx = vec_new();
+	int nfds = MAX(pty, conn->rxfd) + 1;
 	for (;;) {
+		struct timeval tv;
 		fd_set rfds, wfds;
 		FD_ZERO(&rfds);
 		FD_ZERO(&wfds);
 		FD_SET(0, &rfds);
-		FD_SET(pty, &rfds);
+		if (pending->len <= MAXPENDING && conn->txlen <= MAXQUEUED) {
+			FD_SET(pty, &rfds);
+		}
+		FD_SET(conn->rxfd, &rfds);
 		if (vec_len(&tx) != 0) {
 			FD_SET(pty, &wfds);
 		}
-		while (select(pty + 1, &rfds, &wfds, NULL, NULL) == -1) {
+		if (conn->txlen > 0) {
+			FD_SET(conn->txfd, &wfds);
+		}
+		while (select(nfds, &rfds, &wfds, NULL,
+		              timeout(&tv, timer_next())) == -1) {
 			if (errno != EINTR) {
 				error(EXIT_FAILURE, errno, "select");
 			}
 		}
+		if (FD_ISSET(conn->rxfd, &rfds)) {
+			avim_rx(conn);
+			process();
+		}
+		if (FD_ISSET(conn->txfd, &wfds)) {
+			avim_tx(conn);
+		}
 		if (FD_ISSET(0, &rfds)) {
 			read_(0, &tx);
 		}
 		if (FD_ISSET(pty, &rfds)) {
 			read_(pty, &rx.d);
-			send_(&rx);
+			if (flushing == 0) {
+				flushing = timer_add(FLUSH_DELAY, flush);
+			}
 		}
 		if (FD_ISSET(pty, &wfds)) {
 			write_(pty, &tx);
 		}
+		timer_run();
 		if (pid == 0) {
+			/* the pty may still hold output of the command */
+			fcntl(pty, F_SETFL, fcntl(pty, F_GETFL) | O_NONBLOCK);
+			ssize_t n, drained = 0;
+			while ((n = read_(pty, &rx.d)) > 0 ||
+			       (n == -1 && errno == EINTR)) {
+				drained += MAX(n, 0);
+			}
+			if (flushing != 0 || drained > 0) {
+				timer_del(flushing);
+				flush();
+			}
+			while (pending->len > 0) {
+				avim_sync(&conn, 1, NULL, 0);
+				process();
+			}
 			break;
 		}
 		if (chld) {
@@ -1,5 +1,14 @@
+#define _GNU_SOURCE
 #include "avim.h"
+#include "hmap.h"
 #include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <time.h>
 
 struct {
 	int opt;
@@ -17,14 +26,75 @@ struct {
 	{'w', "cwd"},
 };
 struct avim_conn **conns;
-void (*handle)(avim_strv *, size_t);
+/* connections by id */
+struct hmap *ids;
+struct avim_conn **touched;
+void (*handle)(struct avim_raw *, struct avim_conn *);
+/* fields of the messages handled in the current batch */
+avim_strv arena;
+int epfd = -1;
+int listenfd = -1;
+int localfd = -1;
+char *sockdir, *sockpath;
 int mode;
 char *cwd;
+/* batch mode: record separator, number of unanswered requests */
+int recsep = -1, failed;
+size_t waiting;
+/* stream mode: lines of stdin are collected up to this size or time (us) */
+#define STREAMMAX (64 << 10)
+#define STREAMDELAY 10000
+/* ... and stdin is not read while this many batches are unanswered */
+#define STREAMPENDING 4
+/* size of vim's queue at which reading from clients stops and resumes */
+#define TXHIGH (8 << 20)
+#define TXLOW (2 << 20)
+int paused;
+unsigned long npaused;
+/* size of vim's queue up to which held back bulk messages are added */
+#define TXBULK (64 << 10)
+const char *bulkcmds[] = {"change", "clear", "load", "scratch"};
+/* clients with held back bulk messages, served round-robin */
+struct producer {
+	struct avim_conn *conn;
+	struct avim_seg *q;
+	size_t pos;
+} *producers;
+size_t nextproducer, held;
+/* $ACMEVIMTRACE */
+FILE *tracefp;
+volatile sig_atomic_t dumpstats;
+struct cmdstat {
+	char *name;
+	/* latencies in microseconds, hist[i] counts the ones < 2^(i+1) */
+	unsigned long hist[32];
+	unsigned long n;
+	uint64_t sum, max;
+} *stats;
+/* requests waiting for a response by "<conn id> <request id or command>" */
+struct inflight {
+	char *key;
+	size_t cmd;
+	uint64_t start;
+	/* the next one with the same key, for requests without id */
+	struct inflight *next;
+};
+struct hmap *inflight;
+/* directories shown by vim, their inotify watches by path and by wd */
+int inotifyfd = -1;
+struct hmap *watches, *watched;
+#define WATCHEVENTS (IN_CREATE | IN_DELETE | IN_MOVE | IN_DELETE_SELF | \
+                     IN_MOVE_SELF | IN_ONLYDIR)
+/* changed directories are collected for this long (ms) and sent together */
+#define WATCHDELAY 50
+int dirtyfd = -1;
+struct hmap *dirty;
 
-void parse(int argc, char *argv[]) {
+int parse(int argc, char *argv[]) {
 	avim_buf opts = vec_new();
-	int opt;
+	int opt, mode = 0;
 	opterr = 0;
+	optind = 0;
 	for (size_t i = 0; i < ARRLEN(cmds); i++) {
 		if (cmds[i].opt != 0) {
 			char optc[2] = {cmds[i].opt};
@@ -34,10 +104,13 @@ void parse(int argc, char *argv[]) {
 	setenv("POSIXLY_CORRECT", "1", 1);
 	while ((opt = getopt(argc, argv, opts)) != -1) {
 		if (opt == '?') {
-			error(EXIT_FAILURE, EINVAL, "-%c", optopt);
+			error(0, EINVAL, "-%c", optopt);
+			mode = -1;
+			break;
 		} else if (mode != 0 && cmds[mode].opt != opt) {
-			error(EXIT_FAILURE, EINVAL, "-%c -%c",
-			      cmds[mode].opt, opt);
+			error(0, EINVAL, "-%c -%c", cmds[mode].opt, opt);
+			mode = -1;
+			break;
 		}
 		for (size_t i = 0; i < ARRLEN(cmds); i++) {
 			if (cmds[i].opt == opt) {
@@ -47,13 +120,14 @@ void parse(int argc, char *argv[]) {
 		}
 	}
 	vec_free(&opts);
+	return mode;
 }
 
-void sendport(struct avim_conn *conn, uint16_t port) {
+void sendport(struct avim_conn *conn, uint16_t port, const char *path) {
 	char buf[16];
 	snprintf(buf, sizeof(buf), "%u", port);
-	const char *msg[] = {"", "port", buf};
-	avim_send(conn, msg, ARRLEN(msg));
+	const char *msg[] = {"", "port", buf, path};
+	avim_send(conn, msg, ARRLEN(msg) - (path == NULL));
 }
 
 uint16_t sockport(int sockfd) {
@@ -65,8 +139,22 @@ uint16_t sockport(int sockfd) {
 	return htons(addr.sin_port);
 }
 
+void nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		error(EXIT_FAILURE, errno, "fcntl");
+	}
+}
+
+void watch(int op, int fd, uint32_t events, void *ptr) {
+	struct epoll_event ev = {.events = events | EPOLLET, .data.ptr = ptr};
+	if (epoll_ctl(epfd, op, fd, &ev) == -1) {
+		error(EXIT_FAILURE, errno, "epoll_ctl");
+	}
+}
+
 int startlisten(void) {
-	int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
 	if (sockfd == -1) {
 		error(EXIT_FAILURE, errno, "socket");
 	}
@@ -77,34 +165,439 @@ int startlisten(void) {
 	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
 		error(EXIT_FAILURE, errno, "bind");
 	}
-	if (listen(sockfd, 10) == -1) {
+	if (listen(sockfd, SOMAXCONN) == -1) {
 		error(EXIT_FAILURE, errno, "listen");
 	}
 	return sockfd;
 }
 
+void cleanup(void) {
+	if (sockpath != NULL) {
+		unlink(sockpath);
+		rmdir(sockdir);
+	}
+}
+
+void sigterm(int sig) {
+	cleanup();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+void sigusr1(int sig) {
+	dumpstats = 1;
+}
+
+void starttrace(void) {
+	const char *path = getenv("ACMEVIMTRACE");
+	if (path == NULL || path[0] == '\0') {
+		signal(SIGUSR1, SIG_IGN);
+		return;
+	}
+	tracefp = fopen(path, "ae");
+	if (tracefp == NULL) {
+		error(0, errno, "%s", path);
+		signal(SIGUSR1, SIG_IGN);
+		return;
+	}
+	stats = vec_new();
+	inflight = hmap_new(1);
+	signal(SIGUSR1, sigusr1);
+}
+
+size_t findstat(const char *name, size_t len) {
+	size_t i, n = vec_len(&stats);
+	for (i = 0; i < n; i++) {
+		if (strlen(stats[i].name) == len &&
+		    memcmp(stats[i].name, name, len) == 0) {
+			return i;
+		}
+	}
+	struct cmdstat *st = vec_dig(&stats, -1, 1);
+	memset(st, 0, sizeof(*st));
+	st->name = xasprintf("%.*s", (int)len, name);
+	return i;
+}
+
+void addstat(struct cmdstat *st, uint64_t t) {
+	int i = 0;
+	while (i < ARRLEN(st->hist) - 1 && t >> (i + 1) != 0) {
+		i++;
+	}
+	st->hist[i]++;
+	st->n++;
+	st->sum += t;
+	st->max = MAX(st->max, t);
+}
+
+/*
+ * Returns the field at p of raw, or the next one if p is a request id, which
+ * is then stored in id if it is not NULL.
+ */
+char *command(struct avim_raw *raw, char *p, size_t *len, char **id,
+              size_t *idlen) {
+	char *rest, *cmd = avim_field(raw, p, len, &rest);
+	if (cmd != NULL && *len > 0 && cmd[0] == '@') {
+		if (id != NULL) {
+			*id = cmd;
+			*idlen = *len;
+		}
+		cmd = avim_field(raw, rest, len, &rest);
+	}
+	if (cmd == NULL) {
+		cmd = "";
+		*len = 0;
+	}
+	return cmd;
+}
+
+/*
+ * Logs the message raw received from (dir '<') or sent to (dir '>') conn.
+ * p points to its command field, optionally preceded by a request id.
+ * Requests are timed until the matching response is sent back.
+ */
+void trace(struct avim_conn *conn, int dir, struct avim_raw *raw, char *p) {
+	uint64_t t = now();
+	size_t len, idlen = 0;
+	char *id = NULL, *cmd = command(raw, p, &len, &id, &idlen);
+	fprintf(tracefp, "%" PRIu64 ".%06" PRIu64 " %lu %c %zu %.*s\n",
+	        t / 1000000, t % 1000000, conn->id, dir, raw->len,
+	        (int)(len < 64 ? len : 64), cmd);
+	int resp = len > 5 && memcmp(cmd, "resp:", 5) == 0;
+	if (dir != '<' && !resp) {
+		return;
+	}
+	if (resp) {
+		cmd += 5;
+		len -= 5;
+	}
+	char *key = id != NULL ?
+		xasprintf("%lu %.*s", conn->id, (int)idlen, id) :
+		xasprintf("%lu %.*s", conn->id, (int)len, cmd);
+	intptr_t *v = hmap_get(inflight, key);
+	if (dir == '<') {
+		struct inflight *req = xmalloc(sizeof(*req));
+		*req = (struct inflight){key, findstat(cmd, len), t, NULL};
+		if (v == NULL) {
+			*hmap_put(inflight, key) = (intptr_t)req;
+			return;
+		}
+		/* requests without id are answered in order */
+		struct inflight *last = (struct inflight *)*v;
+		while (last->next != NULL) {
+			last = last->next;
+		}
+		last->next = req;
+		return;
+	} else if (v != NULL) {
+		struct inflight *req = (struct inflight *)*v;
+		addstat(&stats[req->cmd], t - req->start);
+		hmap_del(inflight, key, NULL);
+		if (req->next != NULL) {
+			*hmap_put(inflight, req->next->key) = (intptr_t)req->next;
+		}
+		free(req->key);
+		free(req);
+	}
+	free(key);
+}
+
+void note(struct avim_conn *conn, const char *what) {
+	uint64_t t = now();
+	fprintf(tracefp, "%" PRIu64 ".%06" PRIu64 " %lu ! %zu %s\n",
+	        t / 1000000, t % 1000000, conn->id, conn->txlen, what);
+}
+
+void untrace(struct avim_conn *conn) {
+	char prefix[24];
+	int n = snprintf(prefix, sizeof(prefix), "%lu ", conn->id);
+	struct hmap_slot *slot;
+	for (size_t i = 0; (slot = hmap_next(inflight, &i)) != NULL;) {
+		if (strncmp((char *)slot->key, prefix, n) != 0) {
+			continue;
+		}
+		struct inflight *req = (struct inflight *)slot->val;
+		hmap_del(inflight, slot->key, NULL);
+		while (req != NULL) {
+			struct inflight *next = req->next;
+			free(req->key);
+			free(req);
+			req = next;
+		}
+		/* the next slot may have moved back into this one */
+		i--;
+	}
+}
+
+void dump(void) {
+	for (size_t i = 0, n = vec_len(&stats); i < n; i++) {
+		struct cmdstat *st = &stats[i];
+		if (st->n == 0) {
+			continue;
+		}
+		fprintf(tracefp, "# %s: %lu, avg %" PRIu64 "us, max %" PRIu64
+		        "us\n", st->name, st->n, st->sum / st->n, st->max);
+		for (size_t j = 0; j < ARRLEN(st->hist); j++) {
+			if (st->hist[j] != 0) {
+				fprintf(tracefp, "#\t< %" PRIu64 "us: %lu\n",
+				        (uint64_t)2 << j, st->hist[j]);
+			}
+		}
+	}
+	fprintf(tracefp, "# clients %s, paused %lu times\n",
+	        paused ? "paused" : "running", npaused);
+	fprintf(tracefp, "# bulk %zu bytes held from %zu clients\n", held,
+	        vec_len(&producers));
+	for (size_t i = 0, n = vec_len(&conns); i < n; i++) {
+		fprintf(tracefp, "#\t%lu: tx %zu, rx %zu\n", conns[i]->id,
+		        conns[i]->txlen, conns[i]->rxtail - conns[i]->rxpos);
+	}
+	fflush(tracefp);
+}
+
+int startlocal(void) {
+	const char *tmp = getenv("XDG_RUNTIME_DIR");
+	if (tmp == NULL || tmp[0] == '\0') {
+		tmp = getenv("TMPDIR");
+	}
+	if (tmp == NULL || tmp[0] == '\0') {
+		tmp = "/tmp";
+	}
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	char *dir = xasprintf("%s/avim.XXXXXX", tmp);
+	if (strlen(dir) + 6 > sizeof(addr.sun_path) || mkdtemp(dir) == NULL) {
+		free(dir);
+		return -1;
+	}
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (sockfd == -1) {
+		error(EXIT_FAILURE, errno, "socket");
+	}
+	sockdir = dir;
+	sockpath = xasprintf("%s/sock", dir);
+	strcpy(addr.sun_path, sockpath);
+	atexit(cleanup);
+	signal(SIGHUP, sigterm);
+	signal(SIGTERM, sigterm);
+	if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(sockfd, SOMAXCONN) == -1) {
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+int trusted(int sockfd) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+		return 0;
+	}
+	return cred.uid == getuid();
+}
+
 struct avim_conn *newconn(int rxfd, int txfd) {
 	struct avim_conn *conn = avim_create(rxfd, txfd);
 	vec_push(&conns, conn);
+	*hmap_put(ids, conn->id) = (intptr_t)conn;
+	if (epfd != -1) {
+		nonblock(rxfd);
+		watch(EPOLL_CTL_ADD, rxfd, EPOLLIN, conn);
+		if (txfd != rxfd) {
+			nonblock(txfd);
+			watch(EPOLL_CTL_ADD, txfd, 0, conn);
+		}
+	}
 	return conn;
 }
 
-void acceptconn(int listenfd) {
-	int sockfd = accept(listenfd, NULL, NULL);
-	if (sockfd != -1) {
-		newconn(sockfd, sockfd);
+void acceptconns(int listenfd) {
+	for (;;) {
+		int sockfd = accept4(listenfd, NULL, NULL,
+		                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sockfd == -1) {
+			if (errno != EINTR) {
+				break;
+			}
+		} else if (listenfd != localfd || trusted(sockfd)) {
+			newconn(sockfd, sockfd);
+		} else {
+			close(sockfd);
+		}
 	}
 }
 
-void closeconn(size_t c) {
-	handle(NULL, c);
-	avim_destroy(conns[c]);
-	vec_erase(&conns, c, 1);
+void closeconn(struct avim_conn *conn) {
+	handle(NULL, conn);
+	if (ids != NULL) {
+		hmap_del(ids, conn->id, NULL);
+	}
+	for (size_t i = 0, n = vec_len(&conns); i < n; i++) {
+		if (conns[i] == conn) {
+			vec_erase(&conns, i, 1);
+			break;
+		}
+	}
+	avim_destroy(conn);
 }
 
-void request(char *argv[], size_t argc) {
-	vec_push(&conns, avim_connect());
+/* Returns the connection with the decimal id in the len bytes at s */
+struct avim_conn *findconn(const char *s, size_t len) {
+	unsigned long id = 0;
+	if (len == 0 || len > 19) {
+		return NULL;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] < '0' || s[i] > '9') {
+			return NULL;
+		}
+		id = id * 10 + (s[i] - '0');
+	}
+	intptr_t *conn = hmap_get(ids, id);
+	return conn != NULL ? (struct avim_conn *)*conn : NULL;
+}
+
+void touch(struct avim_conn *conn) {
+	if (!conn->touched) {
+		conn->touched = 1;
+		vec_push(&touched, conn);
+	}
+}
+
+void arm(struct avim_conn *conn) {
+	int out = conn->txlen > 0;
+	if (conn->txfd != -1 && conn->armed != out) {
+		uint32_t events = out ? EPOLLOUT : 0;
+		if (conn->txfd == conn->rxfd) {
+			events |= EPOLLIN;
+		}
+		watch(EPOLL_CTL_MOD, conn->txfd, events, conn);
+		conn->armed = out;
+	}
+}
+
+int isbulk(struct avim_raw *raw, char *p) {
+	size_t len;
+	char *cmd = command(raw, p, &len, NULL, NULL);
+	for (size_t i = 0; i < ARRLEN(bulkcmds); i++) {
+		if (strlen(bulkcmds[i]) == len &&
+		    memcmp(bulkcmds[i], cmd, len) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+size_t findproducer(struct avim_conn *conn) {
+	for (size_t i = 0, n = vec_len(&producers); i < n; i++) {
+		if (producers[i].conn == conn) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Takes the message just queued for vim back and holds it with the other
+ * bulk messages of conn, so that interactive ones can overtake it.
+ */
+void hold(struct avim_conn *conn) {
+	struct avim_conn *vim = conns[0];
+	size_t n = vec_len(&vim->tx);
+	struct avim_seg seg = vim->tx[n - 1];
+	vec_erase(&vim->tx, n - 1, 1);
+	vim->txlen -= seg.len;
+	held += seg.len;
+	size_t i = findproducer(conn);
+	if (i == -1) {
+		struct producer p = {conn, vec_new(), 0};
+		i = vec_len(&producers);
+		vec_push(&producers, p);
+	}
+	vec_push(&producers[i].q, seg);
+}
+
+/* Queues the next held back message for vim */
+int schedule(void) {
+	size_t n = vec_len(&producers);
+	if (n == 0) {
+		return 0;
+	}
+	size_t i = nextproducer < n ? nextproducer : 0;
+	struct producer *p = &producers[i];
+	struct avim_seg seg = p->q[p->pos++];
+	avim_queue(conns[0], seg.d, seg.len);
+	held -= seg.len;
+	if (p->pos == vec_len(&p->q)) {
+		vec_free(&p->q);
+		vec_erase(&producers, i, 1);
+	} else {
+		if (p->pos >= 64 && p->pos > vec_len(&p->q) / 2) {
+			vec_erase(&p->q, 0, p->pos);
+			p->pos = 0;
+		}
+		i++;
+	}
+	nextproducer = i;
+	return 1;
+}
+
+void flush(struct avim_conn *conn) {
+	do {
+		while (conn->txlen > 0 && avim_tx(conn) > 0);
+	} while (conn == conns[0] && conn->txlen < TXBULK && schedule());
+	arm(conn);
+}
+
+/* Clients without held back messages are only stopped by vim's own queue */
+int blocked(struct avim_conn *conn) {
+	if (conn == conns[0]) {
+		return 0;
+	} else if (findproducer(conn) == -1) {
+		return conns[0]->txlen > TXHIGH;
+	}
+	return paused || conns[0]->txlen + held > TXHIGH;
+}
+
+/*
+ * Stops reading from clients while vim's queue is above TXHIGH, so that
+ * they block on their full socket buffers, until it drops below TXLOW.
+ */
+void throttle(void) {
+	struct avim_conn *vim = conns[0];
+	if (!paused && vim->txlen + held > TXHIGH) {
+		paused = 1;
+		npaused++;
+		if (tracefp != NULL) {
+			note(vim, "pause");
+		}
+	} else if (paused && vim->txlen + held < TXLOW) {
+		paused = 0;
+		if (tracefp != NULL) {
+			note(vim, "resume");
+		}
+		/* edge-triggered, read what arrived in the meantime */
+		for (size_t i = 1, n = vec_len(&conns); i < n; i++) {
+			struct avim_conn *conn = conns[i];
+			while (conn->rxfd != -1 && avim_rx(conn) > 0);
+			touch(conn);
+		}
+	}
+}
+
+void request(const char *id, int mode, char *argv[], size_t argc) {
 	avim_strv req = vec_new();
+	if (id != NULL) {
+		vec_push(&req, (char *)id);
+	}
 	vec_push(&req, cmds[mode].name);
 	int cmd = cmds[mode].opt;
 	if (cmd == 'p' || cmd == 's') {
@@ -123,79 +616,537 @@ void request(char *argv[], size_t argc) {
 		vec_push(&req, arg);
 	}
 	avim_send(conns[0], (const char **)req, vec_len(&req));
+	vec_free(&req);
+}
+
+/*
+ * Sends the commands read from stdin, one per record, with their arguments
+ * separated by tabs as they would be on the command line.
+ */
+void batch(void) {
+	char *line = NULL, id[24];
+	size_t size = 0, n = 0;
+	ssize_t len;
+	vec_push(&conns, avim_connect());
+	while ((len = getdelim(&line, &size, recsep, stdin)) != -1) {
+		n++;
+		if (len > 0 && line[len - 1] == recsep) {
+			line[--len] = '\0';
+		}
+		if (len == 0) {
+			continue;
+		}
+		avim_strv argv = vec_new();
+		vec_push(&argv, (char *)argv0);
+		for (char *p = line; p != NULL;) {
+			vec_push(&argv, p);
+			p = strchr(p, '\t');
+			if (p != NULL) {
+				*p++ = '\0';
+			}
+		}
+		int m = parse(vec_len(&argv), argv);
+		if (m == -1) {
+			printf("%zu\terror%c", n, recsep);
+			failed = 1;
+		} else {
+			snprintf(id, sizeof(id), "@%zu", n);
+			request(id, m, &argv[optind], vec_len(&argv) - optind);
+			waiting++;
+		}
+		vec_free(&argv);
+	}
+	free(line);
+	if (waiting == 0) {
+		exit(failed ? EXIT_FAILURE : 0);
+	}
+}
+
+/*
+ * Appends the first len bytes of data to buffer b, at its start if first.
+ * Large batches are passed in a memfd, which is returned to be closed with
+ * the response.
+ */
+int append(const char *b, avim_buf *data, size_t len, int first) {
+	const char **msg = vec_new();
+	char *p = *data, *end = p + len, path[48];
+	if (len > 0 && end[-1] != '\n') {
+		/* the last line is incomplete at EOF */
+		vec_insert(data, len, '\n');
+		p = *data;
+		end = p + ++len;
+	}
+	int fd = avim_memfd(p, len, path, sizeof(path));
+	vec_push(&msg, fd != -1 ? "load" : "change");
+	vec_push(&msg, b);
+	vec_push(&msg, first ? "1" : "-1");
+	vec_push(&msg, "-1");
+	if (fd != -1) {
+		vec_push(&msg, path);
+	}
+	while (fd == -1 && p < end) {
+		char *nl = memchr(p, '\n', end - p);
+		*nl = '\0';
+		vec_push(&msg, p);
+		p = nl + 1;
+	}
+	avim_send(conns[0], msg, vec_len(&msg));
+	vec_free(&msg);
+	vec_erase(data, 0, len);
+	return fd;
+}
+
+/*
+ * Streams stdin into a new scratch buffer. Complete lines are collected for
+ * up to STREAMDELAY and appended with a single change request. Longer lines
+ * are collected until their end.
+ */
+void stream(void) {
+	struct avim_conn *conn = avim_connect();
+	avim_buf data = vec_new();
+	char *b = NULL;
+	int eof = 0, first = 1;
+	/* memfds of the unanswered requests, -1 for plain changes */
+	int *unanswered = vec_new();
+	uint64_t since = 0;
+	vec_push(&conns, conn);
+	request(NULL, mode, NULL, 0);
+	for (;;) {
+		avim_strv msg;
+		while ((msg = avim_parse(conn)) != NULL) {
+			size_t argc = vec_len(&msg);
+			if (argc > 0 && strcmp(msg[0], "resp:scratch") == 0) {
+				if (argc < 2) {
+					error(EXIT_FAILURE, 0, "no scratch buffer");
+				}
+				b = xstrdup(msg[1]);
+			} else if (argc > 0 && vec_len(&unanswered) > 0 &&
+			           (strcmp(msg[0], "resp:change") == 0 ||
+			            strcmp(msg[0], "resp:load") == 0)) {
+				if (argc < 2 || strcmp(msg[1], "0") == 0) {
+					error(EXIT_FAILURE, 0, "buffer closed");
+				}
+				if (unanswered[0] != -1) {
+					close(unanswered[0]);
+				}
+				vec_erase(&unanswered, 0, 1);
+			} else {
+				avim_ack(conn, msg, argc);
+			}
+			vec_free(&msg);
+		}
+		avim_pop(conn);
+		size_t len = vec_len(&data);
+		char *nl = len > 0 ? memrchr(data, '\n', len) : NULL;
+		size_t n = eof ? len : nl != NULL ? nl - data + 1 : 0;
+		int timeout = -1;
+		if (b != NULL && n > 0) {
+			uint64_t t = now();
+			if (eof || len >= STREAMMAX || t >= since + STREAMDELAY) {
+				vec_push(&unanswered, append(b, &data, n, first));
+				first = 0;
+				since = t;
+				continue;
+			}
+			timeout = (since + STREAMDELAY - t + 999) / 1000;
+		}
+		if (eof && len == 0 && vec_len(&unanswered) == 0) {
+			exit(0);
+		}
+		struct pollfd fds[] = {
+			{conn->rxfd, POLLIN, 0},
+			{conn->txfd, conn->txlen > 0 ? POLLOUT : 0, 0},
+			{eof || (len >= STREAMMAX && (n > 0 || b == NULL)) ||
+			 conn->txlen >= STREAMMAX ||
+			 vec_len(&unanswered) >= STREAMPENDING ? -1 : 0, POLLIN, 0},
+		};
+		while (poll(fds, ARRLEN(fds), timeout) == -1) {
+			if (errno != EINTR) {
+				error(EXIT_FAILURE, errno, "poll");
+			}
+		}
+		if (fds[1].revents & (POLLOUT | POLLERR)) {
+			avim_tx(conn);
+		}
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			avim_rx(conn);
+			if (conn->rxfd == -1) {
+				error(EXIT_FAILURE, conn->err, "connection closed");
+			}
+		}
+		if (fds[2].revents & (POLLIN | POLLHUP | POLLERR)) {
+			char *p = vec_dig(&data, -1, STREAMMAX);
+			ssize_t r = read(0, p, STREAMMAX);
+			vec_erase(&data, len + MAX(r, 0), STREAMMAX - MAX(r, 0));
+			if (r == 0) {
+				eof = 1;
+			} else if (r == -1 && errno != EINTR && errno != EAGAIN) {
+				error(EXIT_FAILURE, errno, "read");
+			} else if (len == 0) {
+				since = now();
+			}
+		}
+	}
+}
+
+/* Adds the watched directory with wd to the ones vim is told about */
+void markdirty(int wd) {
+	intptr_t *path = hmap_get(watched, wd);
+	if (path == NULL || hmap_get(dirty, *path) != NULL) {
+		return;
+	}
+	if (dirty->len == 0) {
+		struct itimerspec its = {{0, 0}, {0, WATCHDELAY * 1000000}};
+		if (timerfd_settime(dirtyfd, 0, &its, NULL) == -1) {
+			error(EXIT_FAILURE, errno, "timerfd_settime");
+		}
+	}
+	hmap_put(dirty, xstrdup((char *)*path));
+}
+
+void unwatch(int wd) {
+	intptr_t path;
+	if (hmap_del(watched, wd, &path)) {
+		hmap_del(watches, path, NULL);
+		free((char *)path);
+	}
+}
+
+/*
+ * Watches exactly the directories in dirs, and tells vim which of them
+ * cannot be watched, so it has to look at them itself.
+ */
+void watchdirs(char **dirs, size_t n) {
+	if (inotifyfd == -1) {
+		inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		dirtyfd = timerfd_create(CLOCK_MONOTONIC,
+		                         TFD_NONBLOCK | TFD_CLOEXEC);
+		if (inotifyfd == -1 || dirtyfd == -1) {
+			error(EXIT_FAILURE, errno, "inotify");
+		}
+		watch(EPOLL_CTL_ADD, inotifyfd, EPOLLIN, &inotifyfd);
+		watch(EPOLL_CTL_ADD, dirtyfd, EPOLLIN, &dirtyfd);
+		watches = hmap_new(1);
+		watched = hmap_new(0);
+		dirty = hmap_new(1);
+	}
+	struct hmap *keep = hmap_new(1);
+	for (size_t i = 0; i < n; i++) {
+		hmap_put(keep, dirs[i]);
+	}
+	struct hmap_slot *slot;
+	for (size_t i = 0; (slot = hmap_next(watches, &i)) != NULL;) {
+		if (hmap_get(keep, slot->key) == NULL) {
+			inotify_rm_watch(inotifyfd, slot->val);
+			unwatch(slot->val);
+			/* the next slot may have moved back into this one */
+			i--;
+		}
+	}
+	hmap_free(&keep);
+	const char **failed = vec_new();
+	vec_push(&failed, "");
+	vec_push(&failed, "unwatched");
+	for (size_t i = 0; i < n; i++) {
+		if (hmap_get(watches, dirs[i]) != NULL) {
+			continue;
+		}
+		int wd = inotify_add_watch(inotifyfd, dirs[i], WATCHEVENTS);
+		if (wd == -1 || hmap_get(watched, wd) != NULL) {
+			/* the same directory under another name is not tracked */
+			vec_push(&failed, dirs[i]);
+			continue;
+		}
+		char *path = xstrdup(dirs[i]);
+		*hmap_put(watches, path) = wd;
+		*hmap_put(watched, wd) = (intptr_t)path;
+		/* vim may have read it before the watch */
+		markdirty(wd);
+	}
+	if (vec_len(&failed) > 2) {
+		avim_send(conns[0], failed, vec_len(&failed));
+		touch(conns[0]);
+	}
+	vec_free(&failed);
+}
+
+void readwatches(void) {
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	while ((n = read(inotifyfd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+		for (char *p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				struct hmap_slot *slot;
+				for (size_t i = 0;
+				     (slot = hmap_next(watched, &i)) != NULL;) {
+					markdirty(slot->key);
+				}
+			} else {
+				markdirty(ev->wd);
+			}
+			if (ev->mask & IN_IGNORED) {
+				/* the directory is gone */
+				unwatch(ev->wd);
+			}
+		}
+	}
 }
 
-void server(avim_strv *msg, size_t c) {
-	if (msg == NULL && c == 0) {
-		error(EXIT_FAILURE, conns[c]->err, "vim connection lost");
+/* Tells vim which of the watched directories changed */
+void senddirty(void) {
+	uint64_t expired;
+	if (read(dirtyfd, &expired, sizeof(expired)) == -1 || dirty->len == 0) {
+		return;
+	}
+	const char **msg = vec_new();
+	vec_push(&msg, "");
+	vec_push(&msg, "dirty");
+	struct hmap_slot *slot;
+	for (size_t i = 0; (slot = hmap_next(dirty, &i)) != NULL;) {
+		vec_push(&msg, (char *)slot->key);
+	}
+	avim_send(conns[0], msg, vec_len(&msg));
+	touch(conns[0]);
+	for (size_t i = 2, n = vec_len(&msg); i < n; i++) {
+		free((char *)msg[i]);
+	}
+	vec_free(&msg);
+	hmap_clear(dirty);
+}
+
+void server(struct avim_raw *raw, struct avim_conn *conn) {
+	int vim = conn == conns[0];
+	if (raw == NULL && vim) {
+		error(EXIT_FAILURE, conn->err, "vim connection lost");
+	}
+	char *head, *rest;
+	size_t len, argc;
+	if (raw == NULL) {
+		size_t i = findproducer(conn);
+		if (i != -1) {
+			/* its held back messages are still delivered */
+			producers[i].conn = NULL;
+		}
+		if (conn->subscribed) {
+			/* lets vim drop its subscriptions */
+			char cid[24];
+			snprintf(cid, sizeof(cid), "%lu", conn->id);
+			const char *msg[] = {cid, "close"};
+			avim_send(conns[0], msg, ARRLEN(msg));
+			touch(conns[0]);
+		}
+		if (tracefp != NULL) {
+			untrace(conn);
+		}
+		return;
 	}
-	if (msg == NULL || vec_len(msg) < 1 + (c == 0)) {
+	if ((head = avim_head(raw, &len, &rest)) == NULL) {
+		return;
+	}
+	if (vim && len == 0) {
+		/* addressed to avim itself */
+		char **argv = avim_split(raw, &arena, &argc);
+		if (argc > 1 && strcmp(argv[1], "watch") == 0) {
+			watchdirs(&argv[2], argc - 2);
+		} else {
+			avim_ack(conn, &argv[1], argc - 1);
+		}
+		return;
+	}
+	if (!vim && len == 5 && memcmp(head, "hello", 5) == 0) {
+		char **argv = avim_split(raw, &arena, &argc);
+		const char *resp[] = {"resp:hello", AVIM_VERSION};
+		avim_send(conn, resp, ARRLEN(resp));
+		conn->v2 = argc > 1 && atoi(argv[1]) >= 2;
+		touch(conn);
+		return;
+	}
+	if (!vim) {
+		if (tracefp != NULL) {
+			trace(conn, '<', raw, raw->d);
+		}
+		int bulk = findproducer(conn) != -1 || isbulk(raw, raw->d);
+		if (!conn->subscribed) {
+			char *cmd = command(raw, raw->d, &len, NULL, NULL);
+			if (len == 9 && memcmp(cmd, "subscribe", 9) == 0) {
+				conn->subscribed = 1;
+			}
+		}
+		char cid[24];
+		snprintf(cid, sizeof(cid), "%lu", conn->id);
+		avim_forward(conns[0], raw, cid, &arena);
+		if (bulk) {
+			hold(conn);
+		}
+		touch(conns[0]);
 		return;
 	}
-	if (c != 0) {
-		vec_insert(msg, 0, conns[c]->id);
-		avim_send(conns[0], (const char **)*msg, vec_len(msg));
-	} else for (size_t i = 0, n = vec_len(&conns); i < n; i++) {
-		if (strcmp(conns[i]->id, (*msg)[0]) == 0) {
-			avim_send(conns[i], (const char **)&(*msg)[1],
-			          vec_len(msg) - 1);
+	struct avim_conn *dst = findconn(head, len);
+	if (dst != NULL && dst != conn && rest != NULL) {
+		if (tracefp != NULL) {
+			trace(dst, '>', raw, rest);
 		}
+		avim_forward(dst, raw, NULL, &arena);
+		touch(dst);
 	}
 }
 
-void client(avim_strv *msg, size_t c) {
-	if (msg == NULL) {
-		error(EXIT_FAILURE, conns[c]->err, "connection closed");
+void client(struct avim_raw *raw, struct avim_conn *conn) {
+	if (raw == NULL) {
+		error(EXIT_FAILURE, conn->err, "connection closed");
 	}
-	if (vec_len(msg) > 0 && strncmp((*msg)[0], "resp:", 5) == 0 &&
-	    strcmp(&(*msg)[0][5], cmds[mode].name) == 0) {
+	size_t argc;
+	char **argv = avim_split(raw, &arena, &argc);
+	if (avim_ack(conn, argv, argc)) {
+		return;
+	}
+	if (recsep != -1) {
+		if (argc > 1 && argv[0][0] == '@') {
+			fputs(&argv[0][1], stdout);
+			for (size_t i = 1; i < argc; i++) {
+				printf("\t%s", argv[i]);
+			}
+			putchar(recsep);
+			if (--waiting == 0) {
+				exit(failed ? EXIT_FAILURE : 0);
+			}
+		}
+		return;
+	}
+	if (argc > 0 && strncmp(argv[0], "resp:", 5) == 0 &&
+	    strcmp(&argv[0][5], cmds[mode].name) == 0) {
 		exit(0);
 	}
 }
 
-void process(size_t c) {
-	struct avim_conn *conn = conns[c];
+void process(struct avim_conn *conn) {
+	struct avim_raw raw;
+	while (!blocked(conn) && avim_next(conn, &raw)) {
+		handle(&raw, conn);
+	}
+	vec_clear(&arena);
+	avim_pop(conn);
+}
+
+void serve(void) {
+	struct epoll_event events[64];
 	for (;;) {
-		avim_strv msg = avim_parse(conn);
-		if (msg == NULL) {
-			break;
+		int n = epoll_wait(epfd, events, ARRLEN(events),
+		                   vec_len(&touched) > 0 ? 0 : -1);
+		if (dumpstats) {
+			dumpstats = 0;
+			dump();
+		}
+		if (n == -1) {
+			if (errno != EINTR) {
+				error(EXIT_FAILURE, errno, "epoll_wait");
+			}
+			continue;
+		}
+		for (int i = 0; i < n; i++) {
+			struct avim_conn *conn = events[i].data.ptr;
+			if (conn == (void *)&listenfd) {
+				acceptconns(listenfd);
+				continue;
+			} else if (conn == (void *)&localfd) {
+				acceptconns(localfd);
+				continue;
+			} else if (conn == (void *)&inotifyfd) {
+				readwatches();
+				continue;
+			} else if (conn == (void *)&dirtyfd) {
+				senddirty();
+				continue;
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+			    !blocked(conn)) {
+				while (conn->rxfd != -1 && avim_rx(conn) > 0);
+			}
+			touch(conn);
+		}
+		/* process() may touch more connections while relaying */
+		for (size_t i = 0; i < vec_len(&touched); i++) {
+			throttle();
+			/* including the messages read together with EOF */
+			if (!blocked(touched[i])) {
+				process(touched[i]);
+			}
+		}
+		/* closeconn() may touch vim again */
+		for (size_t i = 0; i < vec_len(&touched); i++) {
+			struct avim_conn *conn = touched[i];
+			conn->touched = 0;
+			if (conn->rxfd != -1) {
+				flush(conn);
+			}
+			/* the messages before EOF are processed after resuming */
+			if (conn->rxfd == -1 && !blocked(conn)) {
+				closeconn(conn);
+			}
+		}
+		vec_clear(&touched);
+		throttle();
+		if (tracefp != NULL) {
+			fflush(tracefp);
 		}
-		handle(&msg, c);
-		vec_free(&msg);
 	}
-	avim_pop(conn);
 }
 
 int main(int argc, char *argv[]) {
 	argv0 = argv[0];
 	conns = vec_new();
+	arena = vec_new();
+	producers = vec_new();
 	cwd = xgetcwd();
-	int listenfd = -1;
-	if (argc == 1) {
+	/* with -j, vim's channel to avim is in json mode */
+	int json = argc == 2 && strcmp(argv[1], "-j") == 0;
+	if (argc == 1 || json) {
 		handle = server;
+		ids = hmap_new(0);
+		touched = vec_new();
+		signal(SIGPIPE, SIG_IGN);
+		starttrace();
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd == -1) {
+			error(EXIT_FAILURE, errno, "epoll_create1");
+		}
 		listenfd = startlisten();
+		watch(EPOLL_CTL_ADD, listenfd, EPOLLIN, &listenfd);
+		localfd = startlocal();
+		if (localfd != -1) {
+			watch(EPOLL_CTL_ADD, localfd, EPOLLIN, &localfd);
+		}
 		struct avim_conn *vim = newconn(0, 1);
-		sendport(vim, sockport(listenfd));
+		vim->json = json;
+		sendport(vim, sockport(listenfd), localfd != -1 ? sockpath : NULL);
+		avim_hello(vim, "");
+		flush(vim);
+		serve();
+	}
+	handle = client;
+	if (argc == 2 && (strcmp(argv[1], "-b") == 0 ||
+	                  strcmp(argv[1], "-z") == 0)) {
+		recsep = argv[1][1] == 'z' ? '\0' : '\n';
+		batch();
 	} else {
-		handle = client;
-		parse(argc, argv);
-		request(&argv[optind], argc - optind);
+		mode = parse(argc, argv);
+		if (mode == -1) {
+			exit(EXIT_FAILURE);
+		} else if (cmds[mode].opt == 's' && optind == argc) {
+			stream();
+		}
+		vec_push(&conns, avim_connect());
+		request(NULL, mode, &argv[optind], argc - optind);
 	}
 	for (;;) {
-		int fd = listenfd;
-		avim_sync(conns, vec_len(&conns), &fd, 1);
-		if (fd != -1) {
-			acceptconn(listenfd);
-		}
-		size_t c = 0;
-		while (c < vec_len(&conns)) {
-			if (conns[c]->rxfd == -1) {
-				closeconn(c);
-			} else {
-				process(c);
-				c++;
-			}
+		avim_sync(conns, 1, NULL, 0);
+		if (conns[0]->rxfd == -1) {
+			closeconn(conns[0]);
 		}
+		process(conns[0]);
 	}
 	return 0;
 }
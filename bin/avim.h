@@ -5,49 +5,71 @@
 #include "vec.h"
 #include <arpa/inet.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#define AVIM_VERSION "2"
+/* Lines of change requests larger than this are passed in a memfd */
+#define AVIM_BULK_MIN 65536
+
 typedef char *avim_buf;
 typedef char **avim_strv;
 
+struct avim_seg {
+	char *d;
+	size_t len;
+};
+
+/* A received message, see avim_next() */
+struct avim_raw {
+	char *d;
+	size_t len;
+	int v2;
+	size_t argi, argc;
+};
+
 struct avim_conn {
-	char *id;
+	unsigned long id;
 	int err;
 	int rxfd, txfd;
-	avim_buf rx, tx;
-	size_t rxend, rxpos;
+	/* peer understands length-prefixed v2 messages */
+	int v2;
+	/* peer is vim with a channel in json mode, see avim_nextj() */
+	int json;
+	avim_buf dec;
+	/* rx is a ring of rxcap bytes, the positions are free-running */
+	char *rx;
+	size_t rxcap, rxpos, rxscan, rxtail;
+	avim_buf wrap;
+	/* queued messages, tx[txpos] is partially written up to txoff */
+	struct avim_seg *tx;
+	size_t txpos, txoff, txlen;
+	int armed, touched, subscribed;
 };
 
-static avim_strv avim_parse(struct avim_conn *conn) {
-	int field = 1;
-	avim_strv msg = vec_new();
-	for (size_t i = conn->rxpos; i < conn->rxend; i++) {
-		if (field) {
-			vec_push(&msg, &conn->rx[i]);
-			field = 0;
-		}
-		if (conn->rx[i] == '\x1e') {
-			conn->rx[i] = '\0';
-			conn->rxpos = i + 1;
-			return msg;
-		} else if (conn->rx[i] == '\x1f') {
-			conn->rx[i] = '\0';
-			field = 1;
-		}
+static void avim_close(struct avim_conn *conn, int errnum) {
+	if (conn->rxfd != conn->txfd) {
+		close(conn->rxfd);
 	}
-	vec_free(&msg);
+	close(conn->txfd);
+	conn->rxfd = -1;
+	conn->txfd = -1;
+	conn->err = errnum;
+}
+
+static void *avim_bad(struct avim_conn *conn) {
+	conn->rxpos = conn->rxtail;
+	avim_close(conn, EPROTO);
 	return NULL;
 }
 
-static void avim_pop(struct avim_conn *conn) {
-	if (conn->rxpos > 0) {
-		vec_erase(&conn->rx, 0, conn->rxpos);
-		conn->rxend -= conn->rxpos;
-		conn->rxpos = 0;
-	}
+static char *avim_rxptr(struct avim_conn *conn, size_t pos) {
+	return &conn->rx[pos & (conn->rxcap - 1)];
 }
 
 static void avim_pushn(avim_buf *buf, const char *s, size_t len) {
@@ -59,101 +81,742 @@ static void avim_push(avim_buf *buf, const char *s) {
 	avim_pushn(buf, s, strlen(s));
 }
 
-static void avim_send(struct avim_conn *conn, const char **argv, size_t argc) {
+static char *avim_rxget(struct avim_conn *conn, size_t pos, size_t len) {
+	char *p = avim_rxptr(conn, pos);
+	size_t n = conn->rx + conn->rxcap - p;
+	if (len <= n) {
+		return p;
+	}
+	/* The data wraps around, make it contiguous */
+	vec_clear(&conn->wrap);
+	avim_pushn(&conn->wrap, p, n);
+	avim_pushn(&conn->wrap, conn->rx, len - n);
+	return conn->wrap;
+}
+
+static size_t avim_rxfind(struct avim_conn *conn, size_t pos, int c) {
+	while (pos < conn->rxtail) {
+		char *p = avim_rxptr(conn, pos);
+		size_t n = conn->rx + conn->rxcap - p;
+		if (n > conn->rxtail - pos) {
+			n = conn->rxtail - pos;
+		}
+		char *q = memchr(p, c, n);
+		if (q != NULL) {
+			return pos + (q - p);
+		}
+		pos += n;
+	}
+	return -1;
+}
+
+static int avim_num(char **s, const char *end, size_t *val) {
+	size_t n = 0;
+	char *p = *s;
+	for (; p < end && p - *s < 20 && *p >= '0' && *p <= '9'; p++) {
+		n = n * 10 + (*p - '0');
+	}
+	if (p == *s || p == end || *p != ':') {
+		return 0;
+	}
+	*s = p + 1;
+	*val = n;
+	return 1;
+}
+
+static int avim_next1(struct avim_conn *conn, struct avim_raw *raw) {
+	size_t pos = avim_rxfind(conn, MAX(conn->rxpos, conn->rxscan), '\x1e');
+	if (pos == -1) {
+		conn->rxscan = conn->rxtail;
+		return 0;
+	}
+	raw->len = pos - conn->rxpos;
+	raw->d = avim_rxget(conn, conn->rxpos, raw->len + 1);
+	raw->v2 = 0;
+	conn->rxpos = pos + 1;
+	return 1;
+}
+
+static int avim_next2(struct avim_conn *conn, struct avim_raw *raw) {
+	size_t avail = conn->rxtail - conn->rxpos, len;
+	size_t n = avail < 22 ? avail : 22;
+	char *p = avim_rxget(conn, conn->rxpos, n), *end = &p[n];
+	if (memchr(p, ':', n) == NULL) {
+		return n < 22 ? 0 : !!avim_bad(conn);
+	}
+	char *q = &p[1];
+	if (!avim_num(&q, end, &len)) {
+		return !!avim_bad(conn);
+	}
+	size_t hdr = q - p;
+	if (len > avail - hdr) {
+		return 0;
+	}
+	p = avim_rxget(conn, conn->rxpos + hdr, len);
+	end = &p[len];
+	for (q = p; q < end; q += n + 1) {
+		if (!avim_num(&q, end, &n) || n >= end - q || q[n] != ',') {
+			return !!avim_bad(conn);
+		}
+	}
+	raw->d = p;
+	raw->len = len;
+	raw->v2 = 1;
+	conn->rxpos += hdr + len;
+	return 1;
+}
+
+static char *avim_ws(char *p, char *end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+		p++;
+	}
+	return p;
+}
+
+static char *avim_utf8(char *p, unsigned long c) {
+	if (c < 0x80) {
+		*p++ = c;
+	} else if (c < 0x800) {
+		*p++ = 0xc0 | c >> 6;
+		*p++ = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		*p++ = 0xe0 | c >> 12;
+		*p++ = 0x80 | (c >> 6 & 0x3f);
+		*p++ = 0x80 | (c & 0x3f);
+	} else {
+		*p++ = 0xf0 | c >> 18;
+		*p++ = 0x80 | (c >> 12 & 0x3f);
+		*p++ = 0x80 | (c >> 6 & 0x3f);
+		*p++ = 0x80 | (c & 0x3f);
+	}
+	return p;
+}
+
+static int avim_hex4(const char *p, const char *end, unsigned long *c) {
+	char hex[5] = {0}, *q;
+	if (end - p < 4) {
+		return 0;
+	}
+	memcpy(hex, p, 4);
+	*c = strtoul(hex, &q, 16);
+	return q == &hex[4];
+}
+
+/*
+ * Unescapes the JSON string at *s, whose opening quote is already skipped,
+ * to out or, if out is NULL, only returns its unescaped length.
+ */
+static size_t avim_jstr(char **s, const char *end, char *out) {
+	static const char esc[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+	char *p = *s, buf[4], *o = out != NULL ? out : buf;
+	size_t len = 0;
+	unsigned long c, lo;
+	while (p < end && *p != '"') {
+		char *q = p;
+		while (q < end && *q != '"' && *q != '\\') {
+			q++;
+		}
+		if (out != NULL) {
+			memcpy(&out[len], p, q - p);
+		}
+		len += q - p;
+		if ((p = q) == end || *p == '"') {
+			break;
+		}
+		if (++p == end) {
+			return -1;
+		} else if (*p != 'u') {
+			const char *e = *p != '\0' ? strchr(esc, *p) : NULL;
+			if (e == NULL || (e - esc) % 2 != 0) {
+				return -1;
+			}
+			o = out != NULL ? &out[len] : buf;
+			*o = e[1];
+			len++;
+			p++;
+			continue;
+		}
+		if (!avim_hex4(++p, end, &c)) {
+			return -1;
+		}
+		p += 4;
+		if (c >= 0xd800 && c < 0xdc00 && end - p >= 6 && p[0] == '\\' &&
+		    p[1] == 'u' && avim_hex4(&p[2], end, &lo) &&
+		    lo >= 0xdc00 && lo < 0xe000) {
+			c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+			p += 6;
+		}
+		o = out != NULL ? &out[len] : buf;
+		len += avim_utf8(o, c) - o;
+	}
+	if (p == end) {
+		return -1;
+	}
+	*s = p + 1;
+	return len;
+}
+
+/* Returns the end of the JSON list or object at p, or NULL */
+static char *avim_jskip(char *p, const char *end) {
+	size_t depth = 0;
+	for (; p < end; p++) {
+		if (*p == '[' || *p == '{') {
+			depth++;
+		} else if ((*p == ']' || *p == '}') && --depth == 0) {
+			return p + 1;
+		} else if (*p == '"') {
+			for (p++; p < end && *p != '"'; p++) {
+				p += *p == '\\';
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Appends the JSON value at *s to dec as a v2 field. Lists and objects are
+ * passed on as their JSON text.
+ */
+static int avim_jfield(char **s, char *end, avim_buf *dec) {
+	char *p = *s, num[24];
+	size_t len;
+	if (*p == '[' || *p == '{') {
+		char *q = avim_jskip(p, end);
+		if (q == NULL) {
+			return 0;
+		}
+		size_t n = snprintf(num, sizeof(num), "%zu:", (size_t)(q - p));
+		avim_pushn(dec, num, n);
+		avim_pushn(dec, p, q - p);
+		p = q;
+	} else if (*p == '"') {
+		p++;
+		char *q = p;
+		if ((len = avim_jstr(&q, end, NULL)) == -1) {
+			return 0;
+		}
+		size_t n = snprintf(num, sizeof(num), "%zu:", len);
+		avim_pushn(dec, num, n);
+		avim_jstr(&p, end, vec_dig(dec, -1, len));
+	} else {
+		char *q = p;
+		while (q < end && *q != ',' && *q != ']' && *q != ' ' &&
+		       *q != '[' && *q != '{' && *q != '"') {
+			q++;
+		}
+		if (q == p) {
+			return 0;
+		}
+		int null = q - p == 4 && memcmp(p, "null", 4) == 0;
+		len = null ? 0 : q - p;
+		size_t n = snprintf(num, sizeof(num), "%zu:", len);
+		avim_pushn(dec, num, n);
+		avim_pushn(dec, p, len);
+		p = q;
+	}
+	vec_push(dec, ',');
+	*s = p;
+	return 1;
+}
+
+/*
+ * Takes the next message of vim in json mode, [<number>,[<value>,...]] on a
+ * line of its own, out of rx and converts it to v2 framing. Malformed lines
+ * are skipped.
+ */
+static int avim_nextj(struct avim_conn *conn, struct avim_raw *raw) {
+	for (;;) {
+		size_t pos = avim_rxfind(conn, MAX(conn->rxpos, conn->rxscan),
+		                         '\n');
+		if (pos == -1) {
+			conn->rxscan = conn->rxtail;
+			return 0;
+		}
+		char *p = avim_rxget(conn, conn->rxpos, pos - conn->rxpos);
+		char *end = &p[pos - conn->rxpos];
+		conn->rxpos = pos + 1;
+		vec_clear(&conn->dec);
+		p = avim_ws(p, end);
+		if (p == end || *p++ != '[') {
+			continue;
+		}
+		while (p < end && *p != ',') {
+			p++;
+		}
+		p = p < end ? avim_ws(p + 1, end) : end;
+		if (p == end || *p++ != '[') {
+			continue;
+		}
+		for (p = avim_ws(p, end); p < end && *p != ']';) {
+			if (!avim_jfield(&p, end, &conn->dec)) {
+				p = end;
+				break;
+			}
+			p = avim_ws(p, end);
+			if (p < end && *p == ',') {
+				p = avim_ws(p + 1, end);
+			}
+		}
+		if (p == end) {
+			continue;
+		}
+		vec_push(&conn->dec, '\0');
+		raw->d = conn->dec;
+		raw->len = vec_len(&conn->dec) - 1;
+		raw->v2 = 1;
+		return 1;
+	}
+}
+
+/*
+ * Takes the next complete message out of rx without splitting it. It stays
+ * valid until the next call to avim_rx().
+ */
+static int avim_next(struct avim_conn *conn, struct avim_raw *raw) {
+	raw->argi = -1;
+	if (conn->rxpos == conn->rxtail) {
+		return 0;
+	} else if (conn->json) {
+		return avim_nextj(conn, raw);
+	} else if (*avim_rxptr(conn, conn->rxpos) == '\x1d') {
+		return avim_next2(conn, raw);
+	} else {
+		return avim_next1(conn, raw);
+	}
+}
+
+/*
+ * Returns the field of raw starting at p and its length, NULL if there is
+ * none. rest is set to the start of the following field or to NULL.
+ */
+static char *avim_field(struct avim_raw *raw, char *p, size_t *len,
+                        char **rest) {
+	char *end = &raw->d[raw->len];
+	if (raw->argi != -1 || p == NULL) {
+		return NULL;
+	} else if (!raw->v2) {
+		char *q = memchr(p, '\x1f', end - p);
+		*len = (q != NULL ? q : end) - p;
+		*rest = q != NULL ? q + 1 : NULL;
+		return p;
+	} else if (p < end && avim_num(&p, end, len)) {
+		*rest = &p[*len + 1] < end ? &p[*len + 1] : NULL;
+		return p;
+	}
+	return NULL;
+}
+
+static char *avim_head(struct avim_raw *raw, size_t *len, char **rest) {
+	return avim_field(raw, raw->d, len, rest);
+}
+
+/*
+ * Splits raw in place and appends pointers to its fields to arena, which
+ * the caller clears after each batch of messages.
+ */
+static char **avim_split(struct avim_raw *raw, avim_strv *arena,
+                         size_t *argc) {
+	if (raw->argi == -1) {
+		char *p = raw->d, *end = &raw->d[raw->len];
+		raw->argi = vec_len(arena);
+		if (!raw->v2) {
+			*end = '\0';
+			vec_push(arena, p);
+			while ((p = memchr(p, '\x1f', end - p)) != NULL) {
+				*p++ = '\0';
+				vec_push(arena, p);
+			}
+		} else {
+			size_t n;
+			for (; p < end && avim_num(&p, end, &n); p += n + 1) {
+				p[n] = '\0';
+				vec_push(arena, p);
+			}
+		}
+		raw->argc = vec_len(arena) - raw->argi;
+	}
+	*argc = raw->argc;
+	return &(*arena)[raw->argi];
+}
+
+static avim_strv avim_parse(struct avim_conn *conn) {
+	struct avim_raw raw;
+	if (!avim_next(conn, &raw)) {
+		return NULL;
+	}
+	size_t argc;
+	avim_strv msg = vec_new();
+	avim_split(&raw, &msg, &argc);
+	return msg;
+}
+
+static void avim_pop(struct avim_conn *conn) {
+	if (conn->rxpos == conn->rxtail) {
+		conn->rxpos = conn->rxscan = conn->rxtail = 0;
+	}
+}
+
+static void avim_queue(struct avim_conn *conn, char *d, size_t len) {
+	struct avim_seg seg = {d, len};
+	vec_push(&conn->tx, seg);
+	conn->txlen += len;
+}
+
+static void avim_send1(struct avim_conn *conn, const char **argv,
+                       size_t argc) {
+	size_t len = argc > 0 ? argc : 1;
+	for (size_t i = 0; i < argc; i++) {
+		len += strlen(argv[i]);
+	}
+	char *d = xmalloc(len), *p = d;
+	for (size_t i = 0; i < argc; i++) {
+		size_t n = strlen(argv[i]);
+		memcpy(p, argv[i], n);
+		p += n;
+		*p++ = '\x1f';
+	}
+	d[len - 1] = '\x1e';
+	avim_queue(conn, d, len);
+}
+
+static void avim_send2(struct avim_conn *conn, const char **argv,
+                       size_t argc) {
+	char hdr[24];
+	size_t len = 0;
+	for (size_t i = 0; i < argc; i++) {
+		size_t n = strlen(argv[i]);
+		len += snprintf(NULL, 0, "%zu", n) + n + 2;
+	}
+	size_t hlen = snprintf(hdr, sizeof(hdr), "\x1d%zu:", len);
+	char *d = xmalloc(hlen + len), *p = d;
+	memcpy(p, hdr, hlen);
+	p += hlen;
+	for (size_t i = 0; i < argc; i++) {
+		size_t n = strlen(argv[i]);
+		p += sprintf(p, "%zu:", n);
+		memcpy(p, argv[i], n);
+		p += n;
+		*p++ = ',';
+	}
+	avim_queue(conn, d, hlen + len);
+}
+
+/* Returns the length of s as a JSON string, or writes it to out */
+static size_t avim_jquote(const char *s, char *out) {
+	size_t len = 2;
+	if (out != NULL) {
+		*out++ = '"';
+	}
+	for (; *s != '\0'; s++) {
+		unsigned char c = *s;
+		size_t n = c == '"' || c == '\\' ? 2 : c < 0x20 ? 6 : 1;
+		if (out != NULL && n == 1) {
+			*out++ = c;
+		} else if (out != NULL && n == 2) {
+			*out++ = '\\';
+			*out++ = c;
+		} else if (out != NULL) {
+			out += sprintf(out, "\\u%04x", c);
+		}
+		len += n;
+	}
+	if (out != NULL) {
+		*out = '"';
+	}
+	return len;
+}
+
+static void avim_sendj(struct avim_conn *conn, const char **argv,
+                       size_t argc) {
+	size_t len = 7 + (argc > 0 ? argc - 1 : 0);
+	for (size_t i = 0; i < argc; i++) {
+		len += avim_jquote(argv[i], NULL);
+	}
+	char *d = xmalloc(len + 1), *p = d;
+	p += sprintf(p, "[0,[");
 	for (size_t i = 0; i < argc; i++) {
 		if (i > 0) {
-			avim_push(&conn->tx, "\x1f");
+			*p++ = ',';
+		}
+		p += avim_jquote(argv[i], p);
+	}
+	sprintf(p, "]]\n");
+	avim_queue(conn, d, len);
+}
+
+static void avim_send(struct avim_conn *conn, const char **argv, size_t argc) {
+	if (conn->json) {
+		avim_sendj(conn, argv, argc);
+	} else if (conn->v2) {
+		avim_send2(conn, argv, argc);
+	} else {
+		avim_send1(conn, argv, argc);
+	}
+}
+
+/*
+ * Writes the len bytes of newline-terminated lines at d to a memfd if they
+ * are large, and stores its path in path for the load command. Returns the
+ * memfd, to be closed with the response, or -1 to send a change request.
+ */
+static int avim_memfd(const char *d, size_t len, char *path, size_t size) {
+	int fd = len >= AVIM_BULK_MIN ? memfd_create("avim", MFD_CLOEXEC) : -1;
+	for (size_t i = 0; fd != -1 && i < len;) {
+		ssize_t n = write(fd, &d[i], len - i);
+		if (n == -1 && errno != EINTR) {
+			close(fd);
+			fd = -1;
 		}
-		avim_push(&conn->tx, argv[i]);
+		i += MAX(n, 0);
+	}
+	if (fd != -1) {
+		snprintf(path, size, "/proc/%d/fd/%d", (int)getpid(), fd);
 	}
-	avim_push(&conn->tx, "\x1e");
+	return fd;
+}
+
+/*
+ * Relays raw to conn with the field pfx prepended or, if pfx is NULL, with
+ * its first field removed. The bytes are copied as they are unless the
+ * framing of the two connections differs or raw was already split.
+ */
+static void avim_forward(struct avim_conn *conn, struct avim_raw *raw,
+                         const char *pfx, avim_strv *arena) {
+	if (raw->argi != -1 || raw->v2 != conn->v2 || conn->json) {
+		size_t argc, i;
+		avim_split(raw, arena, &argc);
+		i = vec_len(arena);
+		if (pfx != NULL) {
+			vec_push(arena, (char *)pfx);
+		}
+		for (size_t j = pfx == NULL; j < argc; j++) {
+			char *arg = (*arena)[raw->argi + j];
+			vec_push(arena, arg);
+		}
+		avim_send(conn, (const char **)&(*arena)[i], vec_len(arena) - i);
+		return;
+	}
+	char hdr[48], *p = raw->d, *end = &raw->d[raw->len], *rest;
+	size_t hlen = 0, n, plen = pfx != NULL ? strlen(pfx) : 0;
+	if (pfx == NULL) {
+		p = avim_head(raw, &n, &rest) != NULL && rest != NULL ? rest : end;
+	}
+	if (raw->v2) {
+		n = pfx != NULL ? snprintf(NULL, 0, "%zu", plen) + plen + 2 : 0;
+		hlen = snprintf(hdr, sizeof(hdr), "\x1d%zu:", n + (end - p));
+		if (pfx != NULL) {
+			hlen += snprintf(&hdr[hlen], sizeof(hdr) - hlen, "%zu:",
+			                 plen);
+		}
+	}
+	size_t len = hlen + (pfx != NULL ? plen + 1 : 0) + (end - p) + !raw->v2;
+	char *d = xmalloc(len), *q = d;
+	memcpy(q, hdr, hlen);
+	q += hlen;
+	if (pfx != NULL) {
+		memcpy(q, pfx, plen);
+		q += plen;
+		*q++ = raw->v2 ? ',' : '\x1f';
+	}
+	memcpy(q, p, end - p);
+	if (!raw->v2) {
+		q[end - p] = '\x1e';
+	}
+	avim_queue(conn, d, len);
+}
+
+static void avim_hello(struct avim_conn *conn, const char *cid) {
+	const char *msg[] = {cid, "hello", AVIM_VERSION};
+	size_t skip = cid == NULL;
+	avim_send(conn, &msg[skip], ARRLEN(msg) - skip);
+}
+
+/* Handles the peer's answer to avim_hello() */
+static int avim_ack(struct avim_conn *conn, char **argv, size_t argc) {
+	if (argc < 1 || strcmp(argv[0], "resp:hello") != 0) {
+		return 0;
+	}
+	conn->v2 = argc > 1 && atoi(argv[1]) >= 2;
+	return 1;
 }
 
 static struct avim_conn *avim_create(int rxfd, int txfd) {
+	static unsigned long lastid;
 	struct avim_conn *conn;
 	conn = xrealloc(NULL, sizeof(*conn));
-	conn->id = xasprintf("%zu", (uintptr_t)conn);
+	conn->id = ++lastid;
 	conn->err = 0;
 	conn->rxfd = rxfd;
 	conn->txfd = txfd;
-	conn->rx = vec_new();
-	conn->tx = vec_new();
-	conn->rxend = 0;
+	conn->v2 = 0;
+	conn->json = 0;
+	conn->dec = vec_new();
+	conn->rx = NULL;
+	conn->rxcap = 0;
 	conn->rxpos = 0;
+	conn->rxscan = 0;
+	conn->rxtail = 0;
+	conn->wrap = vec_new();
+	conn->tx = vec_new();
+	conn->txpos = 0;
+	conn->txoff = 0;
+	conn->txlen = 0;
+	conn->armed = 0;
+	conn->touched = 0;
+	conn->subscribed = 0;
 	return conn;
 }
 
-static struct avim_conn *avim_connect(void) {
-	const char *avimport = getenv("ACMEVIMPORT");
-	if (avimport == NULL) {
-		error(EXIT_FAILURE, EINVAL, "ACMEVIMPORT");
-	}
-	char *end;
-	unsigned long port = strtoul(avimport, &end, 0);
-	if (*end != '\0' || port > USHRT_MAX) {
-		error(EXIT_FAILURE, EINVAL, "ACMEVIMPORT");
-	}
-	struct sockaddr_in addr;
+static int avim_dial(const char *path) {
+	struct sockaddr_un addr;
 	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
-	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-	int sockfd = socket(PF_INET, SOCK_STREAM, 0);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (sockfd == -1) {
 		error(EXIT_FAILURE, errno, "socket");
 	}
 	if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-		error(EXIT_FAILURE, errno, "connect");
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+static struct avim_conn *avim_connect(void) {
+	const char *avimsock = getenv("ACMEVIMSOCK");
+	int sockfd = -1;
+	if (avimsock != NULL && avimsock[0] != '\0') {
+		sockfd = avim_dial(avimsock);
+	}
+	if (sockfd == -1) {
+		const char *avimport = getenv("ACMEVIMPORT");
+		if (avimport == NULL) {
+			error(EXIT_FAILURE, EINVAL, "ACMEVIMPORT");
+		}
+		char *end;
+		unsigned long port = strtoul(avimport, &end, 0);
+		if (*end != '\0' || port > USHRT_MAX) {
+			error(EXIT_FAILURE, EINVAL, "ACMEVIMPORT");
+		}
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+		sockfd = socket(PF_INET, SOCK_STREAM, 0);
+		if (sockfd == -1) {
+			error(EXIT_FAILURE, errno, "socket");
+		}
+		if (connect(sockfd, (struct sockaddr *)&addr,
+		            sizeof(addr)) == -1) {
+			error(EXIT_FAILURE, errno, "connect");
+		}
 	}
-	return avim_create(sockfd, sockfd);
+	struct avim_conn *conn = avim_create(sockfd, sockfd);
+	avim_hello(conn, NULL);
+	return conn;
 }
 
 static void avim_destroy(struct avim_conn *conn) {
-	free(conn->id);
-	vec_free(&conn->rx);
+	for (size_t i = conn->txpos, n = vec_len(&conn->tx); i < n; i++) {
+		free(conn->tx[i].d);
+	}
+	free(conn->rx);
+	vec_free(&conn->wrap);
+	vec_free(&conn->dec);
 	vec_free(&conn->tx);
 	free(conn);
 }
 
-static void avim_close(struct avim_conn *conn, int errnum) {
-	if (conn->rxfd != conn->txfd) {
-		close(conn->rxfd);
+static void avim_grow(struct avim_conn *conn) {
+	size_t used = conn->rxtail - conn->rxpos;
+	size_t cap = conn->rxcap != 0 ? conn->rxcap * 2 : 4096;
+	if (cap < conn->rxcap) {
+		error(EXIT_FAILURE, ENOMEM, "avim_grow");
 	}
-	close(conn->txfd);
-	conn->rxfd = -1;
-	conn->txfd = -1;
-	conn->err = errnum;
+	char *rx = xmalloc(cap);
+	if (used > 0) {
+		char *p = avim_rxptr(conn, conn->rxpos);
+		size_t n = conn->rx + conn->rxcap - p;
+		n = n < used ? n : used;
+		memcpy(rx, p, n);
+		memcpy(&rx[n], conn->rx, used - n);
+	}
+	free(conn->rx);
+	conn->rx = rx;
+	conn->rxcap = cap;
+	conn->rxscan = MAX(conn->rxscan, conn->rxpos) - conn->rxpos;
+	conn->rxtail = used;
+	conn->rxpos = 0;
 }
 
-static void avim_rx(struct avim_conn *conn) {
-	static char buf[1024];
-loop:	ssize_t n = read(conn->rxfd, buf, ARRLEN(buf));
+static ssize_t avim_rx(struct avim_conn *conn) {
+	if (conn->rxcap - (conn->rxtail - conn->rxpos) < 1024) {
+		avim_grow(conn);
+	}
+	char *p = avim_rxptr(conn, conn->rxtail);
+	char *q = avim_rxptr(conn, conn->rxpos);
+	struct iovec iov[2] = {{p, conn->rx + conn->rxcap - p}, {conn->rx, 0}};
+	if (q > p) {
+		iov[0].iov_len = q - p;
+	} else {
+		iov[1].iov_len = q - conn->rx;
+	}
+loop:	ssize_t n = readv(conn->rxfd, iov, 1 + (iov[1].iov_len > 0));
 	if (n == -1 && errno == EINTR) {
 		goto loop;
 	}
 	if (n > 0) {
-		for (size_t i = n; i > 0; i--) {
-			if (buf[i - 1] == '\x1e') {
-				conn->rxend = vec_len(&conn->rx) + i;
-				break;
-			}
-		}
-		avim_pushn(&conn->rx, buf, n);
+		conn->rxtail += n;
 	} else if (n == 0 || errno != EAGAIN) {
 		avim_close(conn, n == -1 ? errno : 0);
 	}
+	return n;
 }
 
-static void avim_tx(struct avim_conn *conn) {
-loop:	ssize_t n = write(conn->txfd, conn->tx, vec_len(&conn->tx));
+static ssize_t avim_tx(struct avim_conn *conn) {
+	struct iovec iov[64];
+	size_t iovcnt = 0;
+	for (size_t i = conn->txpos, n = vec_len(&conn->tx);
+	     i < n && iovcnt < ARRLEN(iov); i++, iovcnt++) {
+		size_t off = i == conn->txpos ? conn->txoff : 0;
+		iov[iovcnt].iov_base = &conn->tx[i].d[off];
+		iov[iovcnt].iov_len = conn->tx[i].len - off;
+	}
+loop:	ssize_t n = writev(conn->txfd, iov, iovcnt);
 	if (n == -1 && errno == EINTR) {
 		goto loop;
 	}
 	if (n != -1) {
-		vec_erase(&conn->tx, 0, n);
+		conn->txlen -= n;
+		for (size_t left = n; left > 0;) {
+			struct avim_seg *seg = &conn->tx[conn->txpos];
+			size_t rest = seg->len - conn->txoff;
+			if (left < rest) {
+				conn->txoff += left;
+				break;
+			}
+			left -= rest;
+			free(seg->d);
+			conn->txpos++;
+			conn->txoff = 0;
+		}
+		if (conn->txpos == vec_len(&conn->tx)) {
+			vec_clear(&conn->tx);
+			conn->txpos = 0;
+		} else if (conn->txpos >= 64 &&
+		           conn->txpos > vec_len(&conn->tx) / 2) {
+			vec_erase(&conn->tx, 0, conn->txpos);
+			conn->txpos = 0;
+		}
 	} else if (errno != EAGAIN) {
 		avim_close(conn, errno);
 	}
+	return n;
 }
 
 static void avim_sync(struct avim_conn **conns, size_t nconn, int *fd,
@@ -167,7 +830,7 @@ static void avim_sync(struct avim_conn **conns, size_t nconn, int *fd,
 		if (maxfd <= conns[i]->rxfd) {
 			maxfd = conns[i]->rxfd + 1;
 		}
-		if (vec_len(&conns[i]->tx) > 0) {
+		if (conns[i]->txlen > 0) {
 			FD_SET(conns[i]->txfd, &writefds);
 			if (maxfd <= conns[i]->txfd) {
 				maxfd = conns[i]->txfd + 1;
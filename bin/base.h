@@ -13,6 +13,7 @@
 #include <unistd.h>
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
 #define ARRLEN(array) (sizeof(array) / sizeof((array)[0]))
 #define xmalloc(size) xrealloc(NULL, (size))
 
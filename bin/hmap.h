@@ -0,0 +1,153 @@
+#ifndef HMAP_H
+#define HMAP_H
+
+#include <stdint.h>
+
+#define hmap_get(m, key) \
+	_hmap_get((m), (intptr_t)(key))
+#define hmap_put(m, key) \
+	_hmap_put((m), (intptr_t)(key))
+#define hmap_del(m, key, val) \
+	_hmap_del((m), (intptr_t)(key), (val))
+
+/*
+ * Hash map with open addressing and linear probing. The keys are integers or
+ * strings, which are not copied. Empty slots have a hash of 0.
+ */
+struct hmap {
+	struct hmap_slot {
+		size_t hash;
+		intptr_t key;
+		intptr_t val;
+	} *slots;
+	size_t cap, len;
+	int str;
+};
+
+static struct hmap *hmap_new(int str) {
+	struct hmap *m = xmalloc(sizeof(*m));
+	memset(m, 0, sizeof(*m));
+	m->str = str;
+	return m;
+}
+
+static void hmap_free(struct hmap **m) {
+	if (*m != NULL) {
+		free((*m)->slots);
+		free(*m);
+		*m = NULL;
+	}
+}
+
+static void hmap_clear(struct hmap *m) {
+	if (m->cap > 0) {
+		memset(m->slots, 0, m->cap * sizeof(m->slots[0]));
+	}
+	m->len = 0;
+}
+
+static size_t hmap_hash(struct hmap *m, intptr_t key) {
+	uint64_t h;
+	if (m->str) {
+		h = 14695981039346656037u;
+		for (const unsigned char *s = (void *)key; *s != '\0'; s++) {
+			h = (h ^ *s) * 1099511628211u;
+		}
+	} else {
+		h = (uint64_t)key * 0x9e3779b97f4a7c15u;
+	}
+	h ^= h >> 32;
+	return h != 0 ? h : 1;
+}
+
+/* Returns the slot of key, or the empty one where it would be inserted */
+static size_t hmap_find(struct hmap *m, intptr_t key, size_t hash) {
+	size_t mask = m->cap - 1, i = hash & mask;
+	for (;; i = (i + 1) & mask) {
+		struct hmap_slot *s = &m->slots[i];
+		if (s->hash == 0 || (s->hash == hash && (m->str ?
+		    strcmp((char *)s->key, (char *)key) == 0 : s->key == key))) {
+			return i;
+		}
+	}
+}
+
+static intptr_t *_hmap_get(struct hmap *m, intptr_t key) {
+	if (m->len == 0) {
+		return NULL;
+	}
+	size_t i = hmap_find(m, key, hmap_hash(m, key));
+	return m->slots[i].hash != 0 ? &m->slots[i].val : NULL;
+}
+
+static void hmap_grow(struct hmap *m) {
+	struct hmap_slot *slots = m->slots;
+	size_t cap = m->cap;
+	m->cap = cap != 0 ? cap * 2 : 16;
+	if (m->cap < cap || m->cap > SIZE_MAX / sizeof(*slots)) {
+		error(EXIT_FAILURE, ENOMEM, "hmap_grow");
+	}
+	m->slots = xmalloc(m->cap * sizeof(*slots));
+	memset(m->slots, 0, m->cap * sizeof(*slots));
+	for (size_t i = 0; i < cap; i++) {
+		if (slots[i].hash != 0) {
+			m->slots[hmap_find(m, slots[i].key, slots[i].hash)] =
+				slots[i];
+		}
+	}
+	free(slots);
+}
+
+/* Returns the value of key, which is added with a value of 0 if missing */
+static intptr_t *_hmap_put(struct hmap *m, intptr_t key) {
+	if ((m->len + 1) * 4 > m->cap * 3) {
+		hmap_grow(m);
+	}
+	size_t hash = hmap_hash(m, key), i = hmap_find(m, key, hash);
+	struct hmap_slot *s = &m->slots[i];
+	if (s->hash == 0) {
+		s->hash = hash;
+		s->key = key;
+		s->val = 0;
+		m->len++;
+	}
+	return &s->val;
+}
+
+/* Removes key and stores its value in val, returns 0 if it is missing */
+static int _hmap_del(struct hmap *m, intptr_t key, intptr_t *val) {
+	if (m->len == 0) {
+		return 0;
+	}
+	size_t mask = m->cap - 1, i = hmap_find(m, key, hmap_hash(m, key));
+	if (m->slots[i].hash == 0) {
+		return 0;
+	}
+	if (val != NULL) {
+		*val = m->slots[i].val;
+	}
+	/* move back the following entries that can no longer be found */
+	for (size_t j = (i + 1) & mask; m->slots[j].hash != 0;
+	     j = (j + 1) & mask) {
+		size_t k = m->slots[j].hash & mask;
+		if (i <= j ? k <= i || k > j : k <= i && k > j) {
+			m->slots[i] = m->slots[j];
+			i = j;
+		}
+	}
+	m->slots[i].hash = 0;
+	m->len--;
+	return 1;
+}
+
+/* Returns the entry at or after *i and advances *i past it */
+static struct hmap_slot *hmap_next(struct hmap *m, size_t *i) {
+	for (; *i < m->cap; (*i)++) {
+		if (m->slots[*i].hash != 0) {
+			return &m->slots[(*i)++];
+		}
+	}
+	return NULL;
+}
+
+#endif /* HMAP_H */
@@ -84,13 +84,43 @@ static void xwritefile(const char *path, const strvec lines) {
 	}
 }
 
-int fncmp(const void *a, const void *b) {
-	return strcoll(*(const char **)a, *(const char **)b);
+enum {
+	LS_PATH = 1, /* prefix the names with the directory */
+	LS_SLASH = 2, /* append a slash to the names of directories */
+};
+
+struct lsent {
+	char *key;
+	char *name;
+};
+
+int lscmp(const void *a, const void *b) {
+	const struct lsent *x = a, *y = b;
+	return strcmp(x->key, y->key);
 }
 
-strvec ls(const char *path) {
-	int dot = strcmp(path, ".") == 0;
-	strvec entries = vec_new();
+/* Returns a key that sorts s with strcmp(3) like strcoll(3) would */
+char *collkey(const char *s) {
+	size_t n = strxfrm(NULL, s, 0) + 1;
+	char *key = xmalloc(n);
+	strxfrm(key, s, n);
+	return key;
+}
+
+int isdirent(DIR *d, struct dirent *e) {
+	struct stat st;
+	if (e->d_type != DT_UNKNOWN && e->d_type != DT_LNK) {
+		return e->d_type == DT_DIR;
+	}
+	return fstatat(dirfd(d), e->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Lists the directory at path sorted like strcoll(3). The file types come
+ * from the directory entries, only unknown ones and symlinks are stat'ed.
+ */
+strvec lsflags(const char *path, int flags) {
+	struct lsent *ents = vec_new();
 	DIR *d = opendir(path);
 	if (d == NULL) {
 		error(EXIT_FAILURE, errno, "%s", path);
@@ -104,17 +134,39 @@ strvec ls(const char *path) {
 			}
 			break;
 		}
-		if (strcmp(e->d_name, ".") != 0 &&
-		    strcmp(e->d_name, "..") != 0) {
-			char *name = dot ?
-				xstrdup(e->d_name) :
-			        xasprintf("%s/%s", path, e->d_name);
-			vec_push(&entries, name);
+		if (strcmp(e->d_name, ".") == 0 ||
+		    strcmp(e->d_name, "..") == 0) {
+			continue;
+		}
+		int slash = flags & LS_SLASH && isdirent(d, e);
+		struct lsent ent = {collkey(e->d_name), NULL};
+		if (flags & LS_PATH) {
+			ent.name = xasprintf("%s/%s%s", path, e->d_name,
+			                     slash ? "/" : "");
+		} else {
+			size_t n = strlen(e->d_name);
+			ent.name = xmalloc(n + slash + 1);
+			memcpy(ent.name, e->d_name, n);
+			ent.name[n] = '/';
+			ent.name[n + slash] = '\0';
 		}
+		vec_push(&ents, ent);
 	}
 	closedir(d);
-	qsort(entries, vec_len(&entries), sizeof(entries[0]), fncmp);
+	size_t n = vec_len(&ents);
+	qsort(ents, n, sizeof(ents[0]), lscmp);
+	strvec entries = vec_new();
+	char **p = vec_dig(&entries, -1, n);
+	for (size_t i = 0; i < n; i++) {
+		p[i] = ents[i].name;
+		free(ents[i].key);
+	}
+	vec_free(&ents);
 	return entries;
 }
 
+strvec ls(const char *path) {
+	return lsflags(path, strcmp(path, ".") != 0 ? LS_PATH : 0);
+}
+
 #endif /* IO_H */
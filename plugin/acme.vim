@@ -42,10 +42,63 @@ function s:FiletypeDetect(w)
 	endif
 endfunc
 
+" The functions called on redraws and messages are compiled where possible
+if has('vim9script')
+def s:Jobs(p: any): list<any>
+	if type(p) == v:t_number
+		return copy(get(s:bufjobs, p, []))
+	endif
+	var found = []
+	for [cmd, l] in items(s:cmdjobs)
+		if cmd =~ p
+			found += l
+		endif
+	endfor
+	return found
+enddef
+
+def AcmeStatusBox(): string
+	return &modified ? "\u2593" : "\u2591"
+enddef
+
+def AcmeStatusTitle(): string
+	var b = bufnr()
+	var sc = get(s:scratch, b, {})
+	var t = sc.title != '' ? sc.title : !has_key(s:bufjobs, b) ? 'Scratch' : ''
+	return fnamemodify(s:cwd[b] .. '/+' .. t, ':~') .. (t != '' ? ' ' : '')
+enddef
+
+def AcmeStatusName(): string
+	if has_key(s:scratch, bufnr())
+		return '%{AcmeStatusTitle()}'
+	endif
+	var f = expand('%')
+	return isdirectory(f) && f != '/' ? '%F/ ' : '%F '
+enddef
+
+def AcmeStatusFlags(): string
+	return '%h%r'
+enddef
+
+def AcmeStatusJobs(): string
+	return get(s:jobstatus, bufnr(), '')
+enddef
+
+def AcmeStatusRuler(): string
+	return &ruler ? &ruf != '' ? ' ' .. &ruf : ' %-14.(%l,%c%V%) %P' : ''
+enddef
+else
 function s:Jobs(p)
-	return filter(copy(s:jobs), type(a:p) == type(0)
-		\ ? 'v:val.buf == a:p'
-		\ : 'v:val.cmd =~ a:p')
+	if type(a:p) == type(0)
+		return copy(get(s:bufjobs, a:p, []))
+	endif
+	let jobs = []
+	for [cmd, l] in items(s:cmdjobs)
+		if cmd =~ a:p
+			let jobs += l
+		endif
+	endfor
+	return jobs
 endfunc
 
 function AcmeStatusBox()
@@ -55,7 +108,7 @@ endfunc
 function AcmeStatusTitle()
 	let b = bufnr()
 	let s = get(s:scratch, b, {})
-	let t = s.title != '' ? s.title : s:Jobs(b) == [] ? 'Scratch' : ''
+	let t = s.title != '' ? s.title : !has_key(s:bufjobs, b) ? 'Scratch' : ''
 	return fnamemodify(s:cwd[b] . '/+' . t, ':~').(t != '' ? ' ' : '')
 endfunc
 
@@ -74,25 +127,48 @@ function AcmeStatusFlags()
 endfunc
 
 function AcmeStatusJobs()
-	return join(map(s:Jobs(bufnr()), '"{".v:val.cmd."}"'), '')
+	return get(s:jobstatus, bufnr(), '')
 endfunc
 
 function AcmeStatusRuler()
 	return &ruler ? &ruf != '' ? ' '.&ruf : ' %-14.(%l,%c%V%) %P' : ''
 endfunc
+endif
 
-function s:Started(job, buf, cmd)
-	call add(s:jobs, {
+" Keeps s:bufjobs, s:cmdjobs and the statusline segment of job's buffer
+function s:IndexJob(job, add)
+	for [jobs, key] in [[s:bufjobs, a:job.buf], [s:cmdjobs, a:job.cmd]]
+		if a:add
+			let jobs[key] = add(get(jobs, key, []), a:job)
+		elseif filter(jobs[key], 'v:val isnot a:job') == []
+			call remove(jobs, key)
+		endif
+	endfor
+	let b = a:job.buf
+	if has_key(s:bufjobs, b)
+		let s:jobstatus[b] = join(map(copy(s:bufjobs[b]),
+			\ '"{".v:val.cmd."}"'), '')
+	elseif has_key(s:jobstatus, b)
+		call remove(s:jobstatus, b)
+	endif
+endfunc
+
+function s:Started(job, buf, out, cmd)
+	let job = {
 		\ 'buf': a:buf,
 		\ 'h': a:job,
 		\ 'cmd': type(a:cmd) == type([]) ? join(a:cmd) : a:cmd,
 		\ 'killed': 0,
-	\ })
+		\ 'out': a:out,
+	\ }
+	call add(s:jobs, job)
+	call s:IndexJob(job, 1)
 	redrawstatus!
 endfunc
 
 function s:RemoveJob(i, status)
 	let job = remove(s:jobs, a:i)
+	call s:IndexJob(job, 0)
 	redrawstatus!
 	if has_key(s:scratch, job.buf)
 		let w = s:BufWin(job.buf)
@@ -104,7 +180,7 @@ function s:RemoveJob(i, status)
 		if a:status == 0
 			echo 'Done:' job.cmd
 		elseif sig != '' && !job.killed
-			let name = bufname(ch_getbufnr(job.h, 'out'))
+			let name = job.out != -1 ? bufname(job.out) : '+Errors'
 			call s:ErrorOpen(name, [toupper(sig).': '.job.cmd])
 		endif
 	endif
@@ -155,13 +231,13 @@ function s:Send(w, inp)
 		call win_execute(a:w, 'normal! G')
 	endif
 	let inp = split(inp, '\n')
-	let job = s:Jobs(b)[0].h
+	let job = s:bufjobs[b][0].h
 	call ch_setoptions(job, {'callback': ''})
 	call ch_sendraw(job, join(inp, "\n")."\n")
 endfunc
 
 function s:Receiver(b)
-	return has_key(s:scratch, a:b) && s:Jobs(a:b) != []
+	return has_key(s:scratch, a:b) && has_key(s:bufjobs, a:b)
 endfunc
 
 function s:New(cmd)
@@ -202,7 +278,8 @@ function s:SetEnv(env)
 	return old
 endfunc
 
-function s:JobStart(cmd, outb, ctxb, opts, inp)
+" Starts cmd with the optional argv a:1 in front of it
+function s:JobStart(cmd, outb, ctxb, opts, inp, ...)
 	let opts = {
 		\ 'exit_cb': 's:Exited',
 		\ 'err_io': 'out',
@@ -211,18 +288,23 @@ function s:JobStart(cmd, outb, ctxb, opts, inp)
 		\ 'out_msg': 0,
 	\ }
 	call extend(opts, a:opts)
+	if a:outb == ''
+		call remove(opts, 'out_buf')
+	endif
 	let cwd = get(a:opts, 'cwd', getcwd())
 	let env = s:SetEnv(s:JobEnv(a:outb))
-	let job = job_start(s:ArgvAxec(a:cmd, cwd), opts)
+	let job = job_start(get(a:000, 0, []) + s:ArgvAxec(a:cmd, cwd), opts)
 	call s:SetEnv(env)
 	if job_status(job) == "fail"
-		return
+		return job
 	endif
-	call s:Started(job, s:BufWin(a:outb) != 0 ? a:outb : a:ctxb, a:cmd)
+	call s:Started(job, s:BufWin(a:outb) != 0 ? a:outb : a:ctxb,
+		\ a:outb != '' ? a:outb : -1, a:cmd)
 	if a:inp != ''
 		call ch_sendraw(job, a:inp)
 		call ch_close_in(job)
 	endif
+	return job
 endfunc
 
 function s:InDir(path, dir)
@@ -270,8 +352,10 @@ function s:ErrorOpen(name, ...)
 		exe w.'wincmd w'
 		let b = s:ErrorLoad(a:name)
 		for job in s:jobs
-			if ch_getbufnr(job.h, 'out') == b && job.buf != b
+			if job.out == b && job.buf != b
+				call s:IndexJob(job, 0)
 				let job.buf = b
+				call s:IndexJob(job, 1)
 			endif
 		endfor
 		call s:New(mod.' sb '.b)
@@ -302,30 +386,230 @@ function s:ErrorExec(cmd, dir, b, inp)
 	endif
 	silent! wall
 	let b = s:ErrorLoad(name)
-	let opts.callback = function('s:ErrorCb', [b])
-	call s:JobStart(a:cmd, b, a:b, opts, a:inp)
+	let max = get(g:, 'acme_errorlines', 2000)
+	" the lines of a capped command must stay at the end of the buffer, the
+	" output of others running at the same time is appended after them
+	let cap = max > 0 && !has_key(s:errcapped, b)
+	if cap
+		call extend(opts, s:ErrorCap(a:cmd, b, (max + 1) / 2))
+	else
+		let opts.callback = function('s:ErrorCb', [b])
+	endif
+	let job = s:JobStart(a:cmd, b, a:b, opts, a:inp)
+	if cap && job_status(job) != 'fail'
+		let s:errcapped[b] = 1
+	endif
 endfunc
 
-function s:System(cmd, dir, inp)
-	let cwd = a:dir != '' ? chdir(a:dir) : ''
-	let env = s:SetEnv(s:JobEnv(''))
-	let out = system(a:cmd, a:inp)
-	call s:SetEnv(env)
-	if cwd != ''
-		call chdir(cwd)
+" Output of a command is shown in +Errors at most every s:errdelay ms. Only
+" its first and last n lines are kept there, all of it goes to a log file.
+let s:errdelay = 100
+let s:errlogs = {}
+" buffers with a running capped command
+let s:errcapped = {}
+" the lines shown by a capped command are marked with a text property, so
+" that they are found again after the user edited +Errors
+let s:errid = 0
+if empty(prop_type_get('acme_errors'))
+	call prop_type_add('acme_errors', {})
+endif
+
+function s:ErrorCap(cmd, b, n)
+	let s:errid += 1
+	let e = {
+		\ 'b': a:b,
+		\ 'cmd': type(a:cmd) == type([]) ? join(a:cmd) : a:cmd,
+		\ 'head': [],
+		\ 'id': s:errid,
+		\ 'log': '',
+		\ 'n': a:n,
+		\ 'partial': '',
+		\ 'shown': 0,
+		\ 'start': 0,
+		\ 'tail': [],
+		\ 'timer': 0,
+		\ 'total': 0,
+	\ }
+	return {
+		\ 'close_cb': function('s:ErrorClose', [e]),
+		\ 'out_cb': function('s:ErrorRecv', [e]),
+		\ 'out_io': 'pipe',
+		\ 'out_mode': 'raw',
+	\ }
+endfunc
+
+function s:ErrorRecv(e, ch, msg)
+	let lines = split(a:e.partial . a:msg, "\n", 1)
+	let a:e.partial = remove(lines, -1)
+	call s:ErrorAdd(a:e, lines)
+	if a:e.timer == 0
+		let a:e.timer = timer_start(s:errdelay,
+			\ {_ -> s:ErrorFlush(a:e)})
+	endif
+endfunc
+
+function s:ErrorAdd(e, lines)
+	let e = a:e
+	let n = min([e.n - len(e.head), len(a:lines)])
+	if n > 0
+		call extend(e.head, a:lines[:n-1])
+	endif
+	let e.total += len(a:lines)
+	if e.log != ''
+		call writefile(a:lines, e.log, 'aS')
+		let tail = e.tail + a:lines[max([len(a:lines) - e.n, 0]):]
+		let e.tail = tail[max([len(tail) - e.n, 0]):]
+		return
+	endif
+	call extend(e.tail, a:lines[n:])
+	if len(e.tail) > e.n
+		" spills from now on
+		if !has_key(s:errlogs, e.b)
+			let s:errlogs[e.b] = tempname()
+		endif
+		let e.log = s:errlogs[e.b]
+		call writefile(['$ '.e.cmd] + e.head + e.tail, e.log, 'aS')
+		call remove(e.tail, 0, len(e.tail) - e.n - 1)
+		call setbufvar(e.b, '&undolevels', -1)
+	endif
+endfunc
+
+function s:ErrorFlush(e)
+	let e = a:e
+	let e.timer = 0
+	if !bufloaded(e.b)
+		return
+	elseif e.start == 0
+		call s:ErrorOpen(bufname(e.b))
+	endif
+	let last = getbufinfo(e.b)[0].linecount
+	let p = {'bufnr': e.b, 'id': e.id, 'type': 'acme_errors'}
+	let first = prop_find(extend({'lnum': 1}, p), 'f')
+	if empty(first)
+		" nothing shown yet or all of it deleted by the user
+		let e.start = last == 1 && getbufoneline(e.b, 1) == '' ? 1 : last + 1
+		let shown = 0
+	else
+		let e.start = first.lnum
+		let shown = prop_find(extend({'lnum': last}, p), 'b').lnum
+			\ - e.start + 1
+	endif
+	let dropped = e.total - len(e.head) - len(e.tail)
+	let lines = e.head + (dropped > 0 ? ['--- '.dropped.
+		\ ' lines dropped, full output in '.e.log] : []) + e.tail
+	" the head is the only part that stays the same after dropping lines,
+	" all of it is replaced if the user added or deleted lines in between
+	let keep = shown != e.shown ? 0 :
+		\ dropped > 0 ? min([e.shown, len(e.head)]) : e.shown
+	let follow = filter(win_findbuf(e.b), 'line(".", v:val) == last')
+	if shown > keep
+		call deletebufline(e.b, e.start + keep, e.start + shown - 1)
+	endif
+	if e.start + keep == 1 && getbufinfo(e.b)[0].linecount == 1
+		\ && getbufoneline(e.b, 1) == ''
+		call setbufline(e.b, 1, lines[keep:])
+	else
+		call appendbufline(e.b, e.start + keep - 1, lines[keep:])
+	endif
+	call prop_add_list(p, map(range(e.start + keep, e.start + len(lines) - 1),
+		\ '[v:val, 1, v:val, 1]'))
+	let e.shown = len(lines)
+	for w in follow
+		call win_execute(w, 'normal! G0')
+	endfor
+endfunc
+
+function s:ErrorClose(e, ch)
+	if a:e.partial != ''
+		call s:ErrorAdd(a:e, [a:e.partial])
+		let a:e.partial = ''
+	endif
+	if a:e.timer != 0
+		call timer_stop(a:e.timer)
+	endif
+	if a:e.total > 0
+		call s:ErrorFlush(a:e)
+	endif
+	if a:e.log != ''
+		call setbufvar(a:e.b, '&undolevels', -123456)
+	endif
+	if bufloaded(a:e.b)
+		call prop_remove({'all': 1, 'bufnr': a:e.b, 'id': a:e.id,
+			\ 'type': 'acme_errors'})
+	endif
+	silent! call remove(s:errcapped, a:e.b)
+endfunc
+
+" Runs cmd as a job. Its output replaces the lines of f from f.start to f.end
+" when it is done, unless they were changed in the meantime.
+function s:FilterStart(cmd, dir, inp, f)
+	let f = extend(a:f, {
+		\ 'b': bufnr(),
+		\ 'cmd': a:cmd,
+		\ 'dir': a:dir,
+		\ 'lines': getline(a:f.start[1], a:f.end[1]),
+		\ 'out': [],
+	\ })
+	let opts = {
+		\ 'close_cb': function('s:FilterDone', [f]),
+		\ 'in_io': a:inp != '' ? 'pipe' : 'null',
+		\ 'out_cb': {_, msg -> add(f.out, msg)},
+		\ 'out_io': 'pipe',
+		\ 'out_mode': 'raw',
+	\ }
+	if a:dir != ''
+		let opts.cwd = a:dir
+	endif
+	call s:JobStart(a:cmd, '', f.b, opts, a:inp)
+endfunc
+
+function s:FilterDone(f, ch)
+	" the window can be in another tab page
+	let w = get(win_findbuf(a:f.b), 0, -1)
+	let name = (a:f.dir != '' ? a:f.dir.'/' : '').'+Errors'
+	if w == -1
+		call s:ErrorOpen(name, ['Not shown anymore: '.a:f.cmd])
+		return
+	elseif getbufline(a:f.b, a:f.start[1], a:f.end[1]) != a:f.lines
+		call s:ErrorOpen(name, ['Changed while running: '.a:f.cmd])
+		return
+	endif
+	call setreg('"', join(a:f.out, ''), a:f.type)
+	call win_execute(w, 'call s:FilterPut(a:f)')
+endfunc
+
+function s:FilterPut(f)
+	" a change of its own to undo, even without typing in between
+	let &undolevels = &undolevels
+	if has_key(a:f, 'mode')
+		" sets the mode used by gv
+		exe 'normal! '.a:f.mode."\<Esc>"
+		call setpos("'<", a:f.start)
+		call setpos("'>", a:f.end)
+		normal! gv""p
+	else
+		call setpos('.', a:f.start)
+		exe 'normal! ""'.a:f.put
 	endif
-	return out
 endfunc
 
 function s:Filter(cmd, dir, inp)
-	call setreg('"', s:System(a:cmd, a:dir, a:inp[0]), a:inp[1])
-	normal! gv""p
+	call s:FilterStart(a:cmd, a:dir, a:inp[0], {
+		\ 'end': getpos("'>"),
+		\ 'mode': visualmode(),
+		\ 'start': getpos("'<"),
+		\ 'type': a:inp[1],
+	\ })
 endfunc
 
 function s:Read(cmd, dir, inp)
 	let end = getcurpos()[4] > strdisplaywidth(getline('.'))
-	call setreg('"', s:System(a:cmd, a:dir, a:inp), 'c')
-	exe 'normal! ""'.(end ? 'p' : 'P')
+	call s:FilterStart(a:cmd, a:dir, a:inp, {
+		\ 'end': getcurpos(),
+		\ 'put': end ? 'p' : 'P',
+		\ 'start': getcurpos(),
+		\ 'type': 'c',
+	\ })
 endfunc
 
 function s:ParseCmd(cmd)
@@ -350,6 +634,8 @@ function s:Run(cmd, dir, b, vis)
 		call s:Filter(cmd, a:dir, sel)
 	elseif io =~ '<'
 		call s:Read(cmd, a:dir, sel[0])
+	elseif io =~ '\^' && s:pageexe != '' && sel[0] == ''
+		call s:ScratchExec(cmd, a:dir, '', '', [s:pageexe])
 	elseif io =~ '\^'
 		call s:ScratchExec(cmd, a:dir, sel[0], '')
 	else
@@ -394,7 +680,7 @@ function s:ScratchCb(b, ch, msg)
 	endif
 endfunc
 
-function s:ScratchExec(cmd, dir, inp, title)
+function s:ScratchExec(cmd, dir, inp, title, ...)
 	call s:ScratchNew(a:title, a:dir)
 	let b = bufnr()
 	let opts = {
@@ -404,7 +690,7 @@ function s:ScratchExec(cmd, dir, inp, title)
 	if a:dir != ''
 		let opts.cwd = a:dir
 	endif
-	call s:JobStart(a:cmd, b, b, opts, a:inp)
+	call call('s:JobStart', [a:cmd, b, b, opts, a:inp] + a:000)
 endfunc
 
 function s:Exec(cmd)
@@ -425,6 +711,30 @@ function s:BufWidth(b)
 	return width
 endfunc
 
+if has('vim9script')
+def s:Columnate(words: list<string>, width: number): list<string>
+	var space = 2
+	var wordw = words->mapnew((_, v) => strwidth(v))
+	var ncol = min([len(words), width / max([5, min(wordw[1 :])])])
+	while ncol > 1
+		var nrow = (len(words) + ncol - 1) / ncol
+		var colw = range(ncol)->map((i, _) =>
+			max(slice(wordw, i * nrow, (i + 1) * nrow)))
+		if reduce(colw, (n, v) => n + v, (ncol - 1) * space) > width
+			ncol -= 1
+			continue
+		endif
+		var lines = repeat([''], nrow)
+		for i in range(len(words))
+			var sep = i + nrow >= len(words) ? '' :
+				repeat(' ', colw[i / nrow] - wordw[i] + space)
+			lines[i % nrow] ..= words[i] .. sep
+		endfor
+		return lines
+	endwhile
+	return words
+enddef
+else
 function s:Columnate(words, width)
 	let space = 2
 	let wordw = map(copy(a:words), 'strwidth(v:val)')
@@ -448,22 +758,81 @@ function s:Columnate(words, width)
 	endwhile
 	return a:words
 endfunc
+endif
+
+" Returns the listing of dir laid out by adir, [] if it is missing or failed
+function s:AdirList(dir, width)
+	if s:direxe != ''
+		let lst = systemlist(shellescape(s:direxe).' -w '.a:width.' -- '.
+			\ shellescape(a:dir))
+		if v:shell_error == 0
+			return lst
+		endif
+	endif
+	return []
+endfunc
+
+function s:ReadDir(dir)
+	let lst = s:AdirList(a:dir, 0)
+	if !empty(lst)
+		return lst
+	endif
+	let lst = ['..'] + readdir(a:dir, 1, {'sort': 'collate'})
+	return map(lst, 'isdirectory(a:dir."/".v:val) ? v:val."/" : v:val')
+endfunc
+
+function s:DirLines(words, width)
+	if s:direxe != ''
+		let lst = systemlist(shellescape(s:direxe).' -w '.a:width.' -',
+			\ a:words)
+		if v:shell_error == 0
+			return lst
+		endif
+	endif
+	return s:Columnate(a:words, a:width)
+endfunc
 
+" Directories watched by avim are only read again after it reported changes,
+" otherwise the cached listing is just laid out again when the width changed
 function s:ListDir()
 	let dir = expand('%')
 	if !isdirectory(dir) || !&modifiable
 		return
 	endif
-	let lst = ['..'] + readdir(dir, 1, {'sort': 'collate'})
-	call map(lst, 'isdirectory(dir."/".v:val) ? v:val."/" : v:val')
-	let width = s:BufWidth(bufnr())
-	let lst = s:Columnate(lst, width)
+	let b = bufnr()
+	let path = s:Path(dir)
+	let d = get(s:dirs, b, {'path': ''})
+	let width = s:BufWidth(b)
+	if d.path !=# path || d.stale || !d.watched
+		let s:dirs[b] = {
+			\ 'path': path,
+			\ 'words': [],
+			\ 'stale': 0,
+			\ 'watched': 0,
+		\ }
+		" also offers the directories avim could not watch again
+		call s:WatchDirs()
+		let d = s:dirs[b]
+		let lst = s:AdirList(dir, width)
+	elseif d.width == width && d.tick == b:changedtick
+		return
+	else
+		let lst = []
+	endif
+	if empty(lst)
+		" the words are only read for laying them out again
+		if empty(d.words)
+			let d.words = s:ReadDir(dir)
+		endif
+		let lst = s:DirLines(d.words, width)
+	endif
 	call setline(1, lst)
 	if len(lst) < line('$')
 		silent exe len(lst)+1.',$d _'
 	endif
 	setl bufhidden=unload buftype=nowrite noswapfile
-	let s:dirwidth[bufnr()] = width
+	let d.width = width
+	let d.tick = b:changedtick
 endfunc
 
 function s:ReloadDirs(...)
@@ -471,13 +840,44 @@ function s:ReloadDirs(...)
 	for w in range(1, winnr('$'))
 		let b = winbufnr(w)
 		if !has_key(done, b) && (a:0 == 0 || (w != a:1 &&
-			\ s:BufWidth(b) != get(s:dirwidth, b)))
+			\ s:BufWidth(b) != get(get(s:dirs, b, {}), 'width')))
 			let done[b] = 1
 			call win_execute(win_getid(w), 'noa call s:ListDir()')
 		endif
 	endfor
 endfunc
 
+function s:WatchDirs()
+	let paths = uniq(sort(map(values(s:dirs), 'v:val.path')))
+	if s:ctrlexe != '' && paths != s:watchset
+		let s:watchset = paths
+		call s:CtrlSend(['', 'watch'] + paths)
+	endif
+	" until avim reports that it cannot watch them
+	for d in values(s:dirs)
+		let d.watched = s:ctrlexe != ''
+	endfor
+endfunc
+
+function s:DirtyDirs(paths)
+	for d in values(s:dirs)
+		if index(a:paths, d.path) != -1
+			let d.stale = 1
+		endif
+	endfor
+	call s:ReloadDirs()
+endfunc
+
+function s:Unwatched(paths)
+	for d in values(s:dirs)
+		if index(a:paths, d.path) != -1
+			let d.watched = 0
+		endif
+	endfor
+	" asked for again when they are listed
+	call filter(s:watchset, 'index(a:paths, v:val) == -1')
+endfunc
+
 function s:Goto(pos)
 	if a:pos =~ '^\v\d+([:,]\d+)?$'
 		let pos = split(a:pos, '[:,]')
@@ -751,6 +1151,56 @@ function s:Scroll(topline)
 	call winrestview(v)
 endfunc
 
+if has('vim9script')
+def s:LineHeight(w: number, l: number): number
+	# Only works without fold, number & sign columns and just with
+	# line wrapping, e.g. 'nobreakindent', 'nolinebreak' & 'nolist'
+	var lw = !getwinvar(w, '&wrap') ? 1 :
+		strdisplaywidth(getbufoneline(winbufnr(w), l))
+	var ww = winwidth(w)
+	return (max([lw, 1]) + ww - 1) / ww
+enddef
+
+def s:Fit(col: list<number>)
+	for w in col
+		var h = 0
+		var wh = winheight(w)
+		var top = line('$', w) + 1
+		while top > 1
+			h += s:LineHeight(w, top - 1)
+			if h > wh
+				break
+			endif
+			top -= 1
+		endwhile
+		if top < getwininfo(w)[0].topline
+			win_execute(w, 'noa call s:Scroll(' .. top .. ')')
+		endif
+	endfor
+enddef
+
+def s:Layout(col: list<number>)
+	var h = reduce(col, (sum, w) => sum + winheight(w), 0)
+	var n = len(col)
+	for w in reverse(col)
+		if n == 1
+			break
+		endif
+		var size = 1
+		if s:Minimized(w)
+			if fnamemodify(bufname(winbufnr(w)), ':t') == 'guide'
+				win_execute(w, 'normal! gg')
+			endif
+		else
+			size = float2nr(h / (n * (n > s:tops ? 1.75 : 1.0)))
+		endif
+		win_move_statusline(win_id2win(w) - 1, winheight(w) - size)
+		h -= size
+		n -= 1
+	endfor
+	timer_start(0, (_) => s:Fit(col))
+enddef
+else
 function s:LineHeight(w, l)
 	" Only works without fold, number & sign columns and just with
 	" line wrapping, e.g. 'nobreakindent', 'nolinebreak' & 'nolist'
@@ -799,6 +1249,7 @@ function s:Layout(col)
 	endfor
 	call timer_start(0, {_ -> s:Fit(a:col)})
 endfunc
+endif
 
 function s:Minimized(w)
 	let isguide = fnamemodify(bufname(winbufnr(a:w)), ':t') == 'guide'
@@ -955,7 +1406,7 @@ function s:Clear(b)
 	endif
 endfunc
 
-function s:Edit(files, cid, cmd)
+function s:Edit(files, cid, resp)
 	for i in range(len(a:files))
 		let new = !s:FileWin(a:files[i])
 		call s:FileOpen(a:files[i], '')
@@ -963,7 +1414,7 @@ function s:Edit(files, cid, cmd)
 			let b = bufnr()
 			let s:editbufs[a:cid] = get(s:editbufs, a:cid) + 1
 			let s:editcids[b] = add(get(s:editcids, b, []), a:cid)
-			let s:editcmds[a:cid] = a:cmd
+			let s:editresp[a:cid] = a:resp
 		endif
 	endfor
 endfunc
@@ -980,13 +1431,65 @@ function s:BufInfo()
 	return flatten(map(wins, 's:WinInfo(win_getid(v:val))'))
 endfunc
 
+" Returns the changedtick and lines l1 to l2 of the loaded buffer of file,
+" only the changedtick if it is still tick
+function s:ReadBuf(file, l1, l2, tick)
+	let path = s:Path(a:file)
+	let info = a:file =~ '^\d*$' ? getbufinfo(s:BufNr(a:file)) :
+		\ filter(getbufinfo({'bufloaded': 1}), 's:Path(v:val.name) == path')
+	if empty(info) || !info[0].loaded
+		return []
+	endif
+	let [b, tick] = [info[0].bufnr, info[0].changedtick]
+	if a:tick is# string(tick)
+		return [tick]
+	endif
+	let last = info[0].linecount
+	return [tick] + getbufline(b, a:l1 < 0 ? a:l1 + last + 1 : a:l1,
+		\ a:l2 < 0 ? a:l2 + last + 1 : a:l2)
+endfunc
+
+if has('vim9script')
+def s:Change(b: number, l1: number, l2: number, lines: list<any>): number
+	var w = win_getid(s:BufWin(b))
+	if w == 0
+		return 0
+	endif
+	var pos = getcurpos(w)
+	var [last, top] = [line('$', w), line('w0', w)]
+	var l = s:Bound(1, l1 < 0 ? l1 + last + 2 : l1, last + 1)
+	var n = s:Bound(0, (l2 < 0 ? l2 + last + 2 : l2) - l + 1,
+		last - l + 1)
+	var i = min([n, len(lines)])
+	if i > 0
+		setbufline(b, l, lines[: i - 1])
+	endif
+	if n < len(lines)
+		appendbufline(b, l + i - 1, lines[i :])
+	elseif n > len(lines)
+		deletebufline(b, l + i, l + n - 1)
+	endif
+	if get(get(s:scratch, b, {}), 'pty') && pos[1] == last
+		pos[1] = line('$', w)
+		pos[2] = 2147483647
+		pos[4] = pos[2]
+		win_execute(w, 'call setpos(".", ' .. string(pos) .. ')')
+		s:scratch[b].prompt = getbufoneline(b, '$')
+	elseif get(get(s:scratch, b, {}), 'pager') && l + n <= top
+		# keeps the view when apage moves its window over the output
+		win_execute(w, 'call winrestview({"topline": ' ..
+			(top + len(lines) - n) .. '})')
+	endif
+	return l
+enddef
+else
 function s:Change(b, l1, l2, lines)
 	let w = win_getid(s:BufWin(a:b))
 	if w == 0
 		return
 	endif
 	let pos = getcurpos(w)
-	let last = line('$', w)
+	let [last, top] = [line('$', w), line('w0', w)]
 	let l = s:Bound(1, a:l1 < 0 ? a:l1 + last + 2 : a:l1, last + 1)
 	let n = s:Bound(0, (a:l2 < 0 ? a:l2 + last + 2 : a:l2) - l + 1,
 		\ last - l + 1)
@@ -1005,9 +1508,14 @@ function s:Change(b, l1, l2, lines)
 		let pos[4] = pos[2]
 		call win_execute(w, 'call setpos(".", pos)')
 		let s:scratch[a:b].prompt = getbufoneline(a:b, '$')
+	elseif get(get(s:scratch, a:b, {}), 'pager') && l + n <= top
+		" keeps the view when apage moves its window over the output
+		call win_execute(w, 'call winrestview({"topline": '.
+			\ (top + len(a:lines) - n).'})')
 	endif
 	return l
 endfunc
+endif
 
 function s:Signal(sig)
 	for job in s:Jobs(bufnr())
@@ -1046,6 +1554,20 @@ function s:Pty(b)
 	call win_execute(w, 'call s:PtyMap()')
 endfunc
 
+" Marks b as showing part of the output of apage, moves the cursor to line l
+function s:Pager(b, l)
+	let w = win_getid(s:BufWin(a:b))
+	if !has_key(s:scratch, a:b) || w == 0
+		return
+	endif
+	let s:scratch[a:b].pager = 1
+	if a:l > 0
+		call win_execute(w, 'call cursor('.a:l.', 1) | normal! zz')
+	else
+		call s:FiletypeDetect(w)
+	endif
+endfunc
+
 function s:SetCwd(b, path)
 	if has_key(s:scratch, a:b)
 		let s:cwd[a:b] = s:Path(a:path)
@@ -1086,76 +1608,281 @@ function s:BufNr(b)
 	return b != 0 ? b : bufnr()
 endfunc
 
-function s:CtrlRecv(ch, data)
-	let len = strridx(a:data, "\x1e")
-	let len += len == -1 ? 0 : len(s:ctrlrx)
-	let s:ctrlrx .= a:data
-	if len == -1
+if has('vim9script')
+def s:CtrlRecv(ch: channel, msg: list<any>)
+	if len(msg) < 2
 		return
 	endif
-	let msgs = strpart(s:ctrlrx, 0, len)
-	let s:ctrlrx = strpart(s:ctrlrx, len + 1)
-	let msgs = map(split(msgs, "\x1e", 1), 'split(v:val, "\x1f", 1)')
-	for msg in msgs
-		if len(msg) < 2
-			continue
+	var [cid, cmd, args] = [msg[0], msg[1], msg[2 :]]
+	var resp: list<any> = []
+	if cmd[0] == '@' && len(args) > 0
+		[resp, cmd, args] = [[cmd], args[0], args[1 :]]
+	endif
+	add(resp, 'resp:' .. cmd)
+	if cmd == 'hello'
+		add(resp, 2)
+	elseif cmd == 'port' && len(args) > 0
+		$ACMEVIMPORT = args[0]
+		$ACMEVIMSOCK = get(args, 1, '')
+	elseif cmd == 'edit' && len(args) > 0
+		s:Edit(args, cid, resp)
+		resp = []
+	elseif cmd == 'open' && len(args) > 0
+		s:FileOpen(args[0], len(args) > 1 ? args[1] : '')
+	elseif cmd == 'clear'
+		for b in args
+			s:Clear(s:BufNr(b))
+		endfor
+	elseif cmd == 'checktime'
+		checktime
+		s:ReloadDirs()
+	elseif cmd == 'scratch' && len(args) > 2
+		s:ScratchExec(args[2 :], args[0], '', args[1])
+	elseif cmd == 'scratch' && len(args) > 1
+		s:ScratchNew(args[1], args[0])
+		add(resp, bufnr())
+	elseif cmd == 'bufinfo'
+		resp += s:BufInfo()
+	elseif cmd == 'save'
+		silent! wall
+	elseif cmd == 'read' && len(args) > 2
+		resp += s:ReadBuf(args[0], str2nr(args[1]),
+			str2nr(args[2]), get(args, 3, ''))
+	elseif cmd == 'change' && len(args) > 2
+		add(resp, s:Change(s:BufNr(args[0]),
+			str2nr(args[1]), str2nr(args[2]), args[3 :]))
+	elseif cmd == 'load' && len(args) > 3
+		# binary keeps the CRs, every line ends with a newline
+		add(resp, s:Change(s:BufNr(args[0]), str2nr(args[1]),
+			str2nr(args[2]), readfile(args[3], 'b')[: -2]))
+	elseif cmd == 'kill'
+		for p in len(args) > 0 ? args : [bufnr()]
+			s:Kill(p)
+		endfor
+	elseif cmd == 'look'
+		s:Look(args)
+	elseif cmd == 'help' && len(args) > 0
+		silent! execute 'help ' .. args[0]
+	elseif cmd == 'pty' && len(args) > 0
+		s:Pty(s:BufNr(args[0]))
+	elseif cmd == 'pager' && len(args) > 0
+		s:Pager(s:BufNr(args[0]), str2nr(get(args, 1, '0')))
+	elseif cmd == 'cwd'
+		if len(args) > 1
+			s:SetCwd(s:BufNr(args[0]), args[1])
+		else
+			add(resp, s:Dir())
 		endif
-		let [cid, cmd, args] = [msg[0], msg[1], msg[2:]]
-		let resp = ["resp:" . cmd]
-		if cmd == 'port' && len(args) > 0
-			let $ACMEVIMPORT = args[0]
-		elseif cmd == 'edit' && len(args) > 0
-			call s:Edit(args, cid, 'edit')
-			let resp = []
-		elseif cmd == 'open' && len(args) > 0
-			call s:FileOpen(args[0], len(args) > 1 ? args[1] : '')
-		elseif cmd == 'clear'
-			for b in args
-				call s:Clear(s:BufNr(b))
-			endfor
-		elseif cmd == 'checktime'
-			checktime
-			call s:ReloadDirs()
-		elseif cmd == 'scratch' && len(args) > 2
-			call s:ScratchExec(args[2:], args[0], '', args[1])
-		elseif cmd == 'bufinfo'
-			let resp += s:BufInfo()
-		elseif cmd == 'save'
-			silent! wall
-		elseif cmd == 'change' && len(args) > 2
-			call add(resp, s:Change(s:BufNr(args[0]),
-				\ str2nr(args[1]), str2nr(args[2]), args[3:]))
-		elseif cmd == 'kill'
-			for p in len(args) > 0 ? args : [bufnr()]
-				call s:Kill(p)
-			endfor
-		elseif cmd == 'look'
-			call s:Look(args)
-		elseif cmd == 'help' && len(args) > 0
-			silent! exe 'help' args[0]
-		elseif cmd == 'pty' && len(args) > 0
-			call s:Pty(s:BufNr(args[0]))
-		elseif cmd == 'cwd'
-			if len(args) > 1
-				call s:SetCwd(s:BufNr(args[0]), args[1])
-			else
-				call add(resp, s:Dir())
-			endif
-		elseif cmd == 'diff' && len(args) > 0
-			call s:Edit(args, cid, 'diff')
-			call s:Diff(args)
-			let resp = []
-		elseif cmd == 'plumb' && len(args) > 1
-			call s:Open(args[1], 0, args[0], 0)
+	elseif cmd == 'diff' && len(args) > 0
+		s:Edit(args, cid, resp)
+		s:Diff(args)
+		resp = []
+	elseif cmd == 'plumb' && len(args) > 1
+		s:Open(args[1], 0, args[0], 0)
+	elseif cmd == 'subscribe' && len(args) > 0
+		add(resp, s:Subscribe(cid, args[0], args[1 :]))
+	elseif cmd == 'unsubscribe'
+		s:Unsubscribe(cid, args)
+	elseif cmd == 'close'
+		s:Unsubscribe(cid, [])
+		resp = []
+	elseif cmd == 'dirty'
+		s:DirtyDirs(args)
+		resp = []
+	elseif cmd == 'unwatched'
+		s:Unwatched(args)
+		resp = []
+	endif
+	if resp != []
+		s:CtrlSend([cid] + resp)
+	endif
+enddef
+else
+function s:CtrlRecv(ch, msg)
+	if len(a:msg) < 2
+		return
+	endif
+	let [cid, cmd, args] = [a:msg[0], a:msg[1], a:msg[2:]]
+	let rid = []
+	if cmd[0] == '@' && len(args) > 0
+		let [rid, cmd, args] = [[cmd], args[0], args[1:]]
+	endif
+	let resp = rid + ["resp:" . cmd]
+	if cmd == 'hello'
+		call add(resp, 2)
+	elseif cmd == 'port' && len(args) > 0
+		let $ACMEVIMPORT = args[0]
+		let $ACMEVIMSOCK = get(args, 1, '')
+	elseif cmd == 'edit' && len(args) > 0
+		call s:Edit(args, cid, resp)
+		let resp = []
+	elseif cmd == 'open' && len(args) > 0
+		call s:FileOpen(args[0], len(args) > 1 ? args[1] : '')
+	elseif cmd == 'clear'
+		for b in args
+			call s:Clear(s:BufNr(b))
+		endfor
+	elseif cmd == 'checktime'
+		checktime
+		call s:ReloadDirs()
+	elseif cmd == 'scratch' && len(args) > 2
+		call s:ScratchExec(args[2:], args[0], '', args[1])
+	elseif cmd == 'scratch' && len(args) > 1
+		call s:ScratchNew(args[1], args[0])
+		call add(resp, bufnr())
+	elseif cmd == 'bufinfo'
+		let resp += s:BufInfo()
+	elseif cmd == 'save'
+		silent! wall
+	elseif cmd == 'read' && len(args) > 2
+		let resp += s:ReadBuf(args[0], str2nr(args[1]),
+			\ str2nr(args[2]), get(args, 3, ''))
+	elseif cmd == 'change' && len(args) > 2
+		call add(resp, s:Change(s:BufNr(args[0]),
+			\ str2nr(args[1]), str2nr(args[2]), args[3:]))
+	elseif cmd == 'load' && len(args) > 3
+		" binary keeps the CRs, every line ends with a newline
+		call add(resp, s:Change(s:BufNr(args[0]), str2nr(args[1]),
+			\ str2nr(args[2]), readfile(args[3], 'b')[:-2]))
+	elseif cmd == 'kill'
+		for p in len(args) > 0 ? args : [bufnr()]
+			call s:Kill(p)
+		endfor
+	elseif cmd == 'look'
+		call s:Look(args)
+	elseif cmd == 'help' && len(args) > 0
+		silent! exe 'help' args[0]
+	elseif cmd == 'pty' && len(args) > 0
+		call s:Pty(s:BufNr(args[0]))
+	elseif cmd == 'pager' && len(args) > 0
+		call s:Pager(s:BufNr(args[0]), str2nr(get(args, 1, '0')))
+	elseif cmd == 'cwd'
+		if len(args) > 1
+			call s:SetCwd(s:BufNr(args[0]), args[1])
+		else
+			call add(resp, s:Dir())
 		endif
-		if resp != []
-			call s:CtrlSend([cid] + resp)
+	elseif cmd == 'diff' && len(args) > 0
+		call s:Edit(args, cid, resp)
+		call s:Diff(args)
+		let resp = []
+	elseif cmd == 'plumb' && len(args) > 1
+		call s:Open(args[1], 0, args[0], 0)
+	elseif cmd == 'subscribe' && len(args) > 0
+		call add(resp, s:Subscribe(cid, args[0], args[1:]))
+	elseif cmd == 'unsubscribe'
+		call s:Unsubscribe(cid, args)
+	elseif cmd == 'close'
+		call s:Unsubscribe(cid, [])
+		let resp = []
+	elseif cmd == 'dirty'
+		call s:DirtyDirs(args)
+		let resp = []
+	elseif cmd == 'unwatched'
+		call s:Unwatched(args)
+		let resp = []
+	endif
+	if resp != []
+		call s:CtrlSend([cid] + resp)
+	endif
+endfunc
+endif
+
+function s:CtrlSend(msg)
+	call ch_sendexpr(s:ctrl, a:msg)
+endfunc
+
+let s:events = ['change', 'cursor', 'layout', 'write']
+
+" Pushes event to client cid for the buffers in files (all if empty)
+function s:Subscribe(cid, event, files)
+	if index(s:events, a:event) < 0
+		return 0
+	endif
+	let bufs = filter(map(copy(a:files), 'v:val =~ ''^\d\+$'' ?
+		\ str2nr(v:val) : bufnr(s:Path(v:val))'), 'v:val > 0')
+	if empty(bufs) && !empty(a:files)
+		" none of the files has a buffer
+		return 0
+	endif
+	let subs = get(s:subs, a:cid, {})
+	let subs[a:event] = bufs
+	let s:subs[a:cid] = subs
+	call s:Listen()
+	if a:event == 'cursor' || a:event == 'layout'
+		call s:CtrlSend([a:cid, 'event', a:event] + s:EventInfo(a:event))
+	endif
+	return 1
+endfunc
+
+function s:Unsubscribe(cid, events)
+	let subs = get(s:subs, a:cid, {})
+	for e in empty(a:events) ? keys(subs) : a:events
+		silent! call remove(subs, e)
+	endfor
+	if empty(subs) && has_key(s:subs, a:cid)
+		call remove(s:subs, a:cid)
+	endif
+	call s:Listen()
+endfunc
+
+function s:EventInfo(event)
+	return a:event == 'cursor' ? s:WinInfo(win_getid()) : s:BufInfo()
+endfunc
+
+" Sends event about buffer b (0 for any) to the subscribed clients
+function s:Notify(event, b, info)
+	for [cid, subs] in items(s:subs)
+		let bufs = get(subs, a:event, v:null)
+		if bufs isnot v:null && (a:b == 0 || empty(bufs) ||
+			\ index(bufs, a:b) >= 0)
+			call s:CtrlSend([cid, 'event', a:event] + a:info)
 		endif
 	endfor
 endfunc
 
-function s:CtrlSend(msg)
-	call ch_sendraw(s:ctrl, join(a:msg, "\x1f") . "\x1e")
+function s:NotifyLayout()
+	if !empty(s:subs) && !s:layoutpending
+		let s:layoutpending = 1
+		call timer_start(0, {_ -> execute('let s:layoutpending = 0 |'.
+			\ 'call s:Notify("layout", 0, s:BufInfo())')})
+	endif
+endfunc
+
+function s:Changed(b, start, end, added, changes)
+	call s:Notify('change', a:b, [fnamemodify(bufname(a:b), ':p'),
+		\ getbufvar(a:b, 'changedtick'), a:start, a:end, a:added])
+endfunc
+
+function s:Written(b, path)
+	if has_key(s:listeners, a:b)
+		call listener_flush(a:b)
+	endif
+	call s:Notify('write', a:b, [a:path])
+endfunc
+
+" Keeps listeners on the buffers with subscribers of change events
+function s:Listen()
+	let want = {}
+	for subs in values(s:subs)
+		if has_key(subs, 'change')
+			for b in empty(subs.change) ? filter(range(1, bufnr('$')),
+				\ 'bufloaded(v:val)') : subs.change
+				let want[b] = 1
+			endfor
+		endif
+	endfor
+	for b in keys(s:listeners)
+		if !has_key(want, b)
+			call listener_remove(remove(s:listeners, b))
+		endif
+	endfor
+	for b in keys(want)
+		if !has_key(s:listeners, b) && bufexists(str2nr(b))
+			let s:listeners[b] = listener_add(function('s:Changed'),
+				\ str2nr(b))
+		endif
+	endfor
 endfunc
 
 function s:BufWinLeave()
@@ -1168,9 +1895,8 @@ function s:BufWinLeave()
 		for cid in remove(s:editcids, b)
 			let s:editbufs[cid] -= 1
 			if s:editbufs[cid] <= 0
-				let cmd = remove(s:editcmds, cid)
 				call remove(s:editbufs, cid)
-				call s:CtrlSend([cid, 'resp:'.cmd])
+				call s:CtrlSend([cid] + remove(s:editresp, cid))
 			endif
 		endfor
 		call timer_start(0, {_ -> execute('silent! bdelete '.b)})
@@ -1194,6 +1920,17 @@ endfunc
 augroup acme_vim
 au!
 au BufEnter * call s:ListDir()
+au BufReadPost,BufNewFile * if !empty(s:subs) | call s:Listen() | endif
+au BufUnload * if has_key(s:listeners, expand('<abuf>')) |
+	\ call listener_remove(remove(s:listeners, expand('<abuf>'))) | endif
+au BufUnload * if has_key(s:dirs, expand('<abuf>')) |
+	\ call remove(s:dirs, expand('<abuf>')) | call s:WatchDirs() | endif
+au BufWritePost * if !empty(s:subs) | call s:Written(str2nr(expand('<abuf>')),
+	\ expand('<afile>:p')) | endif
+au CursorMoved,CursorMovedI,WinEnter * if !empty(s:subs) |
+	\ call s:Notify('cursor', bufnr(), s:WinInfo(win_getid())) | endif
+au BufWinEnter,VimResized,WinResized,WinClosed,WinNew *
+	\ call s:NotifyLayout()
 au BufWinLeave * call s:BufWinLeave()
 au FocusGained * call s:ReloadDirs()
 au TextChanged,TextChangedI guide setl nomodified
@@ -1215,22 +1952,30 @@ let &statusline = '%{AcmeStatusBox()}%<%{%AcmeStatusName()%}' .
 
 let s:avimdir = expand('<sfile>:p:h:h')
 let s:ctrlexe = exepath(s:avimdir.'/bin/avim')
-let s:ctrlrx = ''
+let s:direxe = exepath(s:avimdir.'/bin/adir')
+let s:pageexe = s:ctrlexe != '' ? exepath(s:avimdir.'/bin/apage') : ''
 let s:cwd = {}
-let s:dirwidth = {}
+let s:dirs = {}
 let s:editbufs = {}
 let s:editcids = {}
-let s:editcmds = {}
+let s:editresp = {}
+let s:bufjobs = {}
+let s:cmdjobs = {}
 let s:jobs = []
+let s:jobstatus = {}
+let s:layoutpending = 0
+let s:listeners = {}
 let s:minimized = {}
 let s:scratch = {}
+let s:subs = {}
 let s:tops = 1
+let s:watchset = []
 
 if s:ctrlexe != ''
-	let s:ctrl = job_start([s:ctrlexe], {
+	let s:ctrl = job_start([s:ctrlexe, '-j'], {
 		\ 'callback': 's:CtrlRecv',
 		\ 'err_io': 'null',
-		\ 'mode': 'raw',
+		\ 'mode': 'json',
 	\ })
 	let $EDITOR = s:ctrlexe
 endif